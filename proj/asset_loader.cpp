@@ -3,167 +3,167 @@
 // https://github.com/syoyo/tinygltf/blob/master/examples/raytrace/gltf-loader.h
 namespace
 {
-    /// Adapts an array of bytes to an array of T. Will advace of byte_stride each
-/// elements.
+    // Start of the first element of an accessor, and the bytes from one element to the next.
+    // Null for accessors without a buffer view, which glTF allows for sparse ones and we don't read
+    const unsigned char* AccessorData(const tinygltf::Model& model, const tinygltf::Accessor& accessor, size_t& stride)
+    {
+        if (accessor.bufferView < 0 || accessor.bufferView >= static_cast<int>(model.bufferViews.size())) { return nullptr; }
+
+        const auto& bufferView = model.bufferViews[accessor.bufferView];
+        stride = static_cast<size_t>(accessor.ByteStride(bufferView));
+        return model.buffers[bufferView.buffer].data.data() + bufferView.byteOffset + accessor.byteOffset;
+    }
+
+    // One index at a time, for interleaved buffers and the signed types glTF doesn't allow but some exporters write
     template <typename T>
-    struct arrayAdapter {
-        /// Pointer to the bytes
-        const unsigned char* dataPtr;
-        /// Number of elements in the array
-        const size_t elemCount;
-        /// Stride in bytes between two elements
-        const size_t stride;
-
-        /// Construct an array adapter.
-        /// \param ptr Pointer to the start of the data, with offset applied
-        /// \param count Number of elements in the array
-        /// \param byte_stride Stride betweens elements in the array
-        arrayAdapter(const unsigned char* ptr, size_t count, size_t byte_stride)
-            : dataPtr(ptr), elemCount(count), stride(byte_stride) {}
-
-        /// Returns a *copy* of a single element. Can't be used to modify it.
-        T operator[](size_t pos) const {
-            if (pos >= elemCount)
-                throw std::out_of_range(
-                    "Tried to access beyond the last element of an array adapter with "
-                    "count " +
-                    std::to_string(elemCount) + " while getting elemnet number " +
-                    std::to_string(pos));
-            return *(reinterpret_cast<const T*>(dataPtr + pos * stride));
-        }
-    };
-
-    /// Interface of any adapted array that returns ingeger data
-    struct intArrayBase {
-        virtual ~intArrayBase() = default;
-        virtual unsigned int operator[](size_t) const = 0;
-        virtual size_t size() const = 0;
-    };
-
-    /// Interface of any adapted array that returns float data
-    struct floatArrayBase {
-        virtual ~floatArrayBase() = default;
-        virtual float operator[](size_t) const = 0;
-        virtual size_t size() const = 0;
-    };
-
-    /// An array that loads interger types, returns them as int
-    template <class T>
-    struct intArray : public intArrayBase {
-        arrayAdapter<T> adapter;
-
-        intArray(const arrayAdapter<T>& a) : adapter(a) {}
-        unsigned int operator[](size_t position) const override {
-            return static_cast<unsigned int>(adapter[position]);
+    void WidenIndices(const unsigned char* data, size_t stride, size_t count, uint* out)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            T index;
+            memcpy(&index, data + i * stride, sizeof(T));
+            out[i] = static_cast<uint>(index);
         }
+    }
 
-        size_t size() const override { return adapter.elemCount; }
-    };
+    // Tightly packed 8 and 16 bit indices, zero extended 16 bytes at a time
+    void WidenIndices(const uint8_t* in, size_t count, uint* out)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            const __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+            const __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi16(lo, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4), _mm_unpackhi_epi16(lo, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8), _mm_unpacklo_epi16(hi, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 12), _mm_unpackhi_epi16(hi, zero));
+        }
+        for (; i < count; i++)
+        {
+            out[i] = in[i];
+        }
+    }
 
-    template <class T>
-    struct floatArray : public floatArrayBase {
-        arrayAdapter<T> adapter;
+    void WidenIndices(const uint16_t* in, size_t count, uint* out)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            const __m128i shorts = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi16(shorts, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4), _mm_unpackhi_epi16(shorts, zero));
+        }
+        for (; i < count; i++)
+        {
+            out[i] = in[i];
+        }
+    }
 
-        floatArray(const arrayAdapter<T>& a) : adapter(a) {}
-        float operator[](size_t position) const override {
-            return static_cast<float>(adapter[position]);
+    // Any index type as 32 bit, empty for types that can't be indices and accessors without data
+    std::vector<uint> ReadIndices(const tinygltf::Model& model, const tinygltf::Accessor& accessor)
+    {
+        size_t stride;
+        const unsigned char* data = AccessorData(model, accessor, stride);
+        if (data == nullptr) { return {}; }
+        const size_t count = accessor.count;
+        const bool isPacked = stride == static_cast<size_t>(tinygltf::GetComponentSizeInBytes(accessor.componentType));
+
+        std::vector<uint> indices(count);
+        switch (accessor.componentType)
+        {
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+            if (isPacked) { memcpy(indices.data(), data, count * sizeof(uint)); }
+            else { WidenIndices<uint32_t>(data, stride, count, indices.data()); }
+            break;
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+            if (isPacked) { WidenIndices(reinterpret_cast<const uint16_t*>(data), count, indices.data()); }
+            else { WidenIndices<uint16_t>(data, stride, count, indices.data()); }
+            break;
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+            if (isPacked) { WidenIndices(reinterpret_cast<const uint8_t*>(data), count, indices.data()); }
+            else { WidenIndices<uint8_t>(data, stride, count, indices.data()); }
+            break;
+        case TINYGLTF_COMPONENT_TYPE_INT:
+            WidenIndices<int32_t>(data, stride, count, indices.data());
+            break;
+        case TINYGLTF_COMPONENT_TYPE_SHORT:
+            WidenIndices<int16_t>(data, stride, count, indices.data());
+            break;
+        case TINYGLTF_COMPONENT_TYPE_BYTE:
+            WidenIndices<int8_t>(data, stride, count, indices.data());
+            break;
+        default:
+            indices.clear();
+            break;
         }
+        return indices;
+    }
 
-        size_t size() const override { return adapter.elemCount; }
-    };
+    // Float vec3 attributes, which is what positions and normals are unless they were quantized, converted straight
+    // onto the end of values. Returns false and leaves values as they were for anything else, or when there is no data
+    bool AppendVec3(const tinygltf::Model& model, const tinygltf::Accessor& accessor, std::vector<float3>& values)
+    {
+        if (accessor.type != TINYGLTF_TYPE_VEC3 || accessor.componentType != TINYGLTF_COMPONENT_TYPE_FLOAT) { return false; }
 
+        size_t stride;
+        const unsigned char* data = AccessorData(model, accessor, stride);
+        if (data == nullptr) { return false; }
+        const size_t count = accessor.count;
 
+        const size_t first = values.size();
+        values.resize(first + count);
+        float3* out = values.data() + first;
 
-#pragma pack(push, 1)
+        // float3 has no padding, so a packed buffer is already in its layout
+        if (stride == sizeof(float3))
+        {
+            memcpy(out, data, count * sizeof(float3));
+            return true;
+        }
 
-    template <typename T>
-    struct v2 {
-        T x, y;
-    };
-    /// 3D vector of floats without padding
-    template <typename T>
-    struct v3 {
-        T x, y, z;
-    };
+        for (size_t i = 0; i < count; i++)
+        {
+            memcpy(out + i, data + i * stride, sizeof(float3));
+        }
+        return true;
+    }
 
-    /// 4D vector of floats without padding
-    template <typename T>
-    struct v4 {
-        T x, y, z, w;
-    };
-
-#pragma pack(pop)
-
-    using v2f = v2<float>;
-    using v3f = v3<float>;
-    using v4f = v4<float>;
-    using v2d = v2<double>;
-    using v3d = v3<double>;
-    using v4d = v4<double>;
-
-    struct v2fArray {
-        arrayAdapter<v2f> adapter;
-        v2fArray(const arrayAdapter<v2f>& a) : adapter(a) {}
-
-        v2f operator[](size_t position) const { return adapter[position]; }
-        size_t size() const { return adapter.elemCount; }
-    };
-
-    struct v3fArray {
-        arrayAdapter<v3f> adapter;
-        v3fArray(const arrayAdapter<v3f>& a) : adapter(a) {}
-
-        v3f operator[](size_t position) const { return adapter[position]; }
-        size_t size() const { return adapter.elemCount; }
-    };
-
-    struct v4fArray {
-        arrayAdapter<v4f> adapter;
-        v4fArray(const arrayAdapter<v4f>& a) : adapter(a) {}
-
-        v4f operator[](size_t position) const { return adapter[position]; }
-        size_t size() const { return adapter.elemCount; }
-    };
-
-    struct v2dArray {
-        arrayAdapter<v2d> adapter;
-        v2dArray(const arrayAdapter<v2d>& a) : adapter(a) {}
-
-        v2d operator[](size_t position) const { return adapter[position]; }
-        size_t size() const { return adapter.elemCount; }
-    };
-
-    struct v3dArray {
-        arrayAdapter<v3d> adapter;
-        v3dArray(const arrayAdapter<v3d>& a) : adapter(a) {}
-
-        v3d operator[](size_t position) const { return adapter[position]; }
-        size_t size() const { return adapter.elemCount; }
-    };
-
-    struct v4dArray {
-        arrayAdapter<v4d> adapter;
-        v4dArray(const arrayAdapter<v4d>& a) : adapter(a) {}
-
-        v4d operator[](size_t position) const { return adapter[position]; }
-        size_t size() const { return adapter.elemCount; }
-    };
+    // Accessor of a vertex attribute, or -1 when the primitive doesn't have it or names one that isn't there
+    int FindAttribute(const tinygltf::Model& model, const tinygltf::Primitive& primitive, const char* name)
+    {
+        const auto it = primitive.attributes.find(name);
+        if (it == primitive.attributes.end() || it->second < 0 || it->second >= static_cast<int>(model.accessors.size())) { return -1; }
+        return it->second;
+    }
 }
 
-Model LoadGLTF(const char* path, const mat4& t)
+Model LoadGLTF(const char* path, const mat4& t, LoadLog log, LoadReport* report)
 {
     //https://github.com/syoyo/tinygltf/blob/master/examples/raytrace/gltf-loader.cc
     // TODO(syoyo): Texture
     // TODO(syoyo): Material
 
+    // Filled whether or not the caller wants it, it is printed from here
+    LoadReport localReport;
+    LoadReport& stats = report ? *report : localReport;
+    stats = LoadReport();
+    const bool detail = log == LoadLog::Detail;
+    Timer totalTimer;
+
     tinygltf::Model model;
     tinygltf::TinyGLTF loader;
     std::string err;
     std::string warn;
 
+    Timer parseTimer;
     bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, path);
+    stats.parseTime = parseTimer.elapsed();
 
-    if (!warn.empty()) {
+    if (!warn.empty() && log != LoadLog::Silent) {
         std::cout << "glTF parse warning: " << warn << std::endl;
     }
 
@@ -175,30 +175,44 @@ Model LoadGLTF(const char* path, const mat4& t)
         return {};
     }
 
-    std::cout << "loaded glTF file has:\n"
-        << model.accessors.size() << " accessors\n"
-        << model.animations.size() << " animations\n"
-        << model.buffers.size() << " buffers\n"
-        << model.bufferViews.size() << " bufferViews\n"
-        << model.materials.size() << " materials\n"
-        << model.meshes.size() << " meshes\n"
-        << model.nodes.size() << " nodes\n"
-        << model.textures.size() << " textures\n"
-        << model.images.size() << " images\n"
-        << model.skins.size() << " skins\n"
-        << model.samplers.size() << " samplers\n"
-        << model.cameras.size() << " cameras\n"
-        << model.scenes.size() << " scenes\n"
-        << model.lights.size() << " lights\n";
-
-    // Create model
+    for (const auto& buffer : model.buffers)
+    {
+        stats.fileBytes += buffer.data.size();
+    }
+
+    if (detail)
+    {
+        std::cout << "loaded glTF file has:\n"
+            << model.accessors.size() << " accessors\n"
+            << model.animations.size() << " animations\n"
+            << model.buffers.size() << " buffers\n"
+            << model.bufferViews.size() << " bufferViews\n"
+            << model.materials.size() << " materials\n"
+            << model.meshes.size() << " meshes\n"
+            << model.nodes.size() << " nodes\n"
+            << model.textures.size() << " textures\n"
+            << model.images.size() << " images\n"
+            << model.skins.size() << " skins\n"
+            << model.samplers.size() << " samplers\n"
+            << model.cameras.size() << " cameras\n"
+            << model.scenes.size() << " scenes\n"
+            << model.lights.size() << " lights\n";
+    }
+
+    // Create model, geometry stays in object space and t is applied at trace time
     Model object;
+    object.transform = t;
+    object.cachePath = std::string(path) + ".bvh";
 
     // Iterate through all the meshes in the glTF file
     for (const auto& gltfMesh : model.meshes)
     {
-        std::cout << "Current mesh has " << gltfMesh.primitives.size()
-            << " primitives:\n";
+        if (detail)
+        {
+            std::cout << "Current mesh has " << gltfMesh.primitives.size()
+                << " primitives:\n";
+        }
+        stats.meshes++;
 
         // Create new mesh
         object.meshes.push_back({});
@@ -207,291 +221,142 @@ Model LoadGLTF(const char* path, const mat4& t)
         // For each primitive
         for (const auto& meshPrimitive : gltfMesh.primitives)
         {
-            // Boolean used to check if we have converted the vertex buffer format
-            bool convertedToTriangleList = false;
+            stats.primitives++;
+            if (meshPrimitive.mode != TINYGLTF_MODE_TRIANGLES)
+            {
+                std::cerr << "primitive mode not implemented\n";
+                stats.skippedPrimitives++;
+                continue;
+            }
 
             // ----------------------
-            // Load indices
+            // Load attributes
             // ----------------------
-            // This permit to get a type agnostic way of reading the index buffer
-            std::unique_ptr<intArrayBase> indicesArrayPtr = nullptr;
+            // Converted in one go onto the end of the mesh, which the primitive shares with those before it
+            const int positionAccessor = FindAttribute(model, meshPrimitive, "POSITION");
+            const int normalAccessor = FindAttribute(model, meshPrimitive, "NORMAL");
+            const size_t offset = mesh.vertices.size();
+            Timer attributeTimer;
+            const bool hasPositions = positionAccessor >= 0 && AppendVec3(model, model.accessors[positionAccessor], mesh.vertices);
+            if (normalAccessor >= 0) { AppendVec3(model, model.accessors[normalAccessor], mesh.normals); }
+            stats.attributeTime += attributeTimer.elapsed();
+            const size_t vertexCount = mesh.vertices.size() - offset;
+            if (!hasPositions || vertexCount == 0)
             {
-                const auto& indicesAccessor = model.accessors[meshPrimitive.indices];
-                const auto& bufferView = model.bufferViews[indicesAccessor.bufferView];
-                const auto& buffer = model.buffers[bufferView.buffer];
-                const auto dataAddress = buffer.data.data() + bufferView.byteOffset +
-                    indicesAccessor.byteOffset;
-                const auto byteStride = indicesAccessor.ByteStride(bufferView);
-                const auto count = indicesAccessor.count;
-
-                // Allocate the index array in the pointer-to-base declared in the
-                // parent scope
-                switch (indicesAccessor.componentType) {
-                case TINYGLTF_COMPONENT_TYPE_BYTE:
-                    indicesArrayPtr =
-                        std::unique_ptr<intArray<char> >(new intArray<char>(
-                            arrayAdapter<char>(dataAddress, count, byteStride)));
-                    break;
-
-                case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
-                    indicesArrayPtr = std::unique_ptr<intArray<unsigned char> >(
-                        new intArray<unsigned char>(arrayAdapter<unsigned char>(
-                            dataAddress, count, byteStride)));
-                    break;
-
-                case TINYGLTF_COMPONENT_TYPE_SHORT:
-                    indicesArrayPtr =
-                        std::unique_ptr<intArray<short> >(new intArray<short>(
-                            arrayAdapter<short>(dataAddress, count, byteStride)));
-                    break;
-
-                case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
-                    indicesArrayPtr = std::unique_ptr<intArray<unsigned short> >(
-                        new intArray<unsigned short>(arrayAdapter<unsigned short>(
-                            dataAddress, count, byteStride)));
-                    break;
-
-                case TINYGLTF_COMPONENT_TYPE_INT:
-                    indicesArrayPtr = std::unique_ptr<intArray<int> >(new intArray<int>(
-                        arrayAdapter<int>(dataAddress, count, byteStride)));
-                    break;
-
-                case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
-                    indicesArrayPtr = std::unique_ptr<intArray<unsigned int> >(
-                        new intArray<unsigned int>(arrayAdapter<unsigned int>(
-                            dataAddress, count, byteStride)));
-                    break;
-                default:
-                    break;
-                }
+                std::cerr << "Unhandeled vector or componant type for position\n";
+                mesh.vertices.resize(offset);
+                mesh.normals.resize(offset);
+                stats.skippedPrimitives++;
+                continue;
+            }
+            const bool hasNormals = mesh.normals.size() == mesh.vertices.size();
+            if (normalAccessor >= 0 && !hasNormals)
+            {
+                std::cerr << "Unhandeled vector or componant type for normal\n";
             }
 
-            // Convert indices
-            const auto& indices = *indicesArrayPtr;
-            if (indicesArrayPtr)
+            // ----------------------
+            // Load indices
+            // ----------------------
+            // Primitives without them use every three vertices in order
+            Timer indexTimer;
+            std::vector<uint> indices;
+            if (meshPrimitive.indices >= 0)
             {
-                std::cout << "indices: ";
-                for (size_t i(0); i < indicesArrayPtr->size(); ++i)
+                indices = ReadIndices(model, model.accessors[meshPrimitive.indices]);
+                if (indices.empty())
                 {
-                    std::cout << indices[i] << " ";
-                    //loadedMesh.faces.push_back(indices[i]);
+                    std::cerr << "Unhandeled componant type or missing buffer for indices\n";
+                    mesh.vertices.resize(offset);
+                    mesh.normals.resize(offset);
+                    stats.skippedPrimitives++;
+                    continue;
                 }
-                std::cout << '\n';
             }
+            else
+            {
+                indices.resize(vertexCount);
+                std::iota(indices.begin(), indices.end(), 0u);
+            }
+            stats.indexTime += indexTimer.elapsed();
+
+            if (!indices.empty() && *std::max_element(indices.begin(), indices.end()) >= vertexCount)
+            {
+                std::cerr << "Index out of range of the " << vertexCount << " vertices\n";
+                mesh.vertices.resize(offset);
+                mesh.normals.resize(offset);
+                stats.skippedPrimitives++;
+                continue;
+            }
+
+            if (detail)
+            {
+                std::cout << "Primitive has " << vertexCount << " vertices, " << (hasNormals ? "with" : "no")
+                    << " normals and " << indices.size() << " indices\n";
+            }
+            stats.vertices += vertexCount;
+            stats.indices += indices.size();
 
             // ----------------------
-            // Intepret vertices with indices to load mesh
+            // Append the indices to the mesh
             // ----------------------
-            switch (meshPrimitive.mode)
+            // They move past the vertices of the primitives before this one.
+            // Vertices without a normal get the average of the geometric normals of their faces
+            Timer faceTimer;
+            const float3* positions = mesh.vertices.data() + offset;
+            const size_t faceCount = indices.size() / 3;
+            const size_t firstIndex = mesh.indices.size();
+            mesh.indices.resize(firstIndex + faceCount * 3);
+            for (size_t i = 0; i < faceCount * 3; i++)
             {
-            case TINYGLTF_MODE_TRIANGLES:  // this is the simpliest case to handle
+                mesh.indices[firstIndex + i] = static_cast<uint>(offset) + indices[i];
+            }
+            if (!hasNormals)
             {
-                for (const auto& attribute : meshPrimitive.attributes)
+                mesh.normals.resize(offset);
+                mesh.normals.resize(mesh.vertices.size(), make_float3(0.f));
+                for (size_t i = 0; i < faceCount; i++)
+                {
+                    const uint a = indices[i * 3], b = indices[i * 3 + 1], c = indices[i * 3 + 2];
+                    // Not normalized, so bigger faces weigh more
+                    const float3 normal = cross(positions[b] - positions[a], positions[c] - positions[a]);
+                    mesh.normals[offset + a] += normal;
+                    mesh.normals[offset + b] += normal;
+                    mesh.normals[offset + c] += normal;
+                }
+                for (size_t i = offset; i < mesh.normals.size(); i++)
                 {
-                    const auto attribAccessor = model.accessors[attribute.second];
-                    const auto& bufferView =
-                        model.bufferViews[attribAccessor.bufferView];
-                    const auto& buffer = model.buffers[bufferView.buffer];
-                    const auto dataPtr = buffer.data.data() + bufferView.byteOffset +
-                        attribAccessor.byteOffset;
-                    const auto byte_stride = attribAccessor.ByteStride(bufferView);
-                    const auto count = attribAccessor.count;
-
-                    std::cout << "current attribute has count " << count
-                        << " and stride " << byte_stride << " bytes\n";
-
-                    std::cout << "attribute string is : " << attribute.first << '\n';
-
-                    // -- Load attributes -- //
-                    if (attribute.first == "POSITION")
-                    {
-                        std::vector<float> vertices;
-                        switch (attribAccessor.type)
-                        {
-                        case TINYGLTF_TYPE_VEC3:
-                        {
-                            switch (attribAccessor.componentType)
-                            {
-                            case TINYGLTF_COMPONENT_TYPE_FLOAT:
-                            {
-                                v3fArray positions(arrayAdapter<v3f>(dataPtr, count, byte_stride));
-
-                                for (size_t i{ 0 }; i < positions.size(); ++i)
-                                {
-                                    const auto va = positions[i];
-                                    float3 v = make_float3(va.x, va.y, va.z);
-                                    v = t.TransformPoint(v);
-
-                                    vertices.push_back(v.x);
-                                    vertices.push_back(v.y);
-                                    vertices.push_back(v.z);
-                                }
-                            }
-                            }
-                        }
-                        }
-                        // Fill by adding a face a time
-                        for (size_t i = 0; i < indices.size(); i += 3)
-                        {
-                            mesh.faces.push_back({});
-                            auto& face = mesh.faces.back();
-
-                            for (size_t j = 0; j < 3; j++)
-                            {
-                                // * 3 since attribs are 3 comps each
-                                face[j].x = vertices[indices[i + j] * 3 + 0];
-                                face[j].y = vertices[indices[i + j] * 3 + 1];
-                                face[j].z = vertices[indices[i + j] * 3 + 2];
-                            }
-                        }
-                    }
-                    if (attribute.first == "NORMAL") 
-                    {
-                        std::vector<float> normalsVec;
-                        switch (attribAccessor.type) 
-                        {
-                        case TINYGLTF_TYPE_VEC3: 
-                        {
-                            switch (attribAccessor.componentType) 
-                            {
-                            case TINYGLTF_COMPONENT_TYPE_FLOAT: 
-                            {
-                                std::cout << "Normal is FLOAT\n";
-                                v3fArray normals(
-                                    arrayAdapter<v3f>(dataPtr, count, byte_stride));
-
-                                for (size_t i{ 0 }; i < normals.size(); i++) {
-                                    const auto va = normals[i];
-                                    float3 v = make_float3(va.x, va.y, va.z);
-                                    v = t.TransformVector(v);
-
-                                    // Put them in the array in the correct order
-                                    normalsVec.push_back(v.x);
-                                    normalsVec.push_back(v.y);
-                                    normalsVec.push_back(v.z);
-                                }
-                            } break;
-                            default:
-                                std::cerr << "Unhandeled componant type for normal\n";
-                            }
-                        } break;
-                        default:
-                            std::cerr << "Unhandeled vector type for normal\n";
-                        }
-                    
-                        // Fill mesh faces
-                        for (size_t i = 0; i < indices.size(); i += 3)
-                        {
-                            mesh.normals.push_back({});
-                            auto& normal = mesh.normals.back();
-
-                            // * 3 since attribs are 3 comps each
-                            normal.x = normalsVec[indices[i] * 3 + 0];
-                            normal.y = normalsVec[indices[i] * 3 + 1];
-                            normal.z = normalsVec[indices[i] * 3 + 2];
-                        }
-                    }
-
-                    /*
-                        // Face varying comment on the normals is also true for the UVs
-                        if (attribute.first == "TEXCOORD_0") {
-                            std::cout << "Found texture coordinates\n";
-
-                            switch (attribAccessor.type) {
-                            case TINYGLTF_TYPE_VEC2: {
-                                std::cout << "TEXTCOORD is VEC2\n";
-                                switch (attribAccessor.componentType) {
-                                case TINYGLTF_COMPONENT_TYPE_FLOAT: {
-                                    std::cout << "TEXTCOORD is FLOAT\n";
-                                    v2fArray uvs(
-                                        arrayAdapter<v2f>(dataPtr, count, byte_stride));
-
-                                    for (size_t i{ 0 }; i < indices.size() / 3; ++i) {
-                                        // get the i'th triange's indexes
-                                        auto f0 = indices[3 * i + 0];
-                                        auto f1 = indices[3 * i + 1];
-                                        auto f2 = indices[3 * i + 2];
-
-                                        // get the texture coordinates for each triangle's
-                                        // vertices
-                                        v2f uv0, uv1, uv2;
-                                        uv0 = uvs[f0];
-                                        uv1 = uvs[f1];
-                                        uv2 = uvs[f2];
-
-                                        // push them in order into the mesh data
-                                        loadedMesh.facevarying_uvs.push_back(uv0.x);
-                                        loadedMesh.facevarying_uvs.push_back(uv0.y);
-
-                                        loadedMesh.facevarying_uvs.push_back(uv1.x);
-                                        loadedMesh.facevarying_uvs.push_back(uv1.y);
-
-                                        loadedMesh.facevarying_uvs.push_back(uv2.x);
-                                        loadedMesh.facevarying_uvs.push_back(uv2.y);
-                                    }
-
-                                } break;
-                                case TINYGLTF_COMPONENT_TYPE_DOUBLE: {
-                                    std::cout << "TEXTCOORD is DOUBLE\n";
-                                    v2dArray uvs(
-                                        arrayAdapter<v2d>(dataPtr, count, byte_stride));
-
-                                    for (size_t i{ 0 }; i < indices.size() / 3; ++i) {
-                                        // get the i'th triange's indexes
-                                        auto f0 = indices[3 * i + 0];
-                                        auto f1 = indices[3 * i + 1];
-                                        auto f2 = indices[3 * i + 2];
-
-                                        v2d uv0, uv1, uv2;
-                                        uv0 = uvs[f0];
-                                        uv1 = uvs[f1];
-                                        uv2 = uvs[f2];
-
-                                        loadedMesh.facevarying_uvs.push_back(uv0.x);
-                                        loadedMesh.facevarying_uvs.push_back(uv0.y);
-
-                                        loadedMesh.facevarying_uvs.push_back(uv1.x);
-                                        loadedMesh.facevarying_uvs.push_back(uv1.y);
-
-                                        loadedMesh.facevarying_uvs.push_back(uv2.x);
-                                        loadedMesh.facevarying_uvs.push_back(uv2.y);
-                                    }
-                                } break;
-                                default:
-                                    std::cerr << "unrecognized vector type for UV";
-                                }
-                            } break;
-                            default:
-                                std::cerr << "unreconized componant type for UV";
-                            }
-                        }
-                    }
-                    */
-                    
-                    // -- Load materials -- //
-                    tinygltf::Material &mat = model.materials[meshPrimitive.material];
-
-                    // Color
-                    // Convert color to unsigned int
-                    auto color = mat.pbrMetallicRoughness.baseColorFactor;
-                    std::vector<uint> comp(4);
-                    std::transform(std::begin(color), std::end(color), std::begin(comp), [](double val)
-                    {return static_cast<uint>(val * 0xff); });
-
-                    mesh.mat.color = *static_cast<Pixel*>(comp.data());
+                    const float length = sqrtf(dot(mesh.normals[i], mesh.normals[i]));
+                    mesh.normals[i] = length > 0.f ? mesh.normals[i] / length : make_float3(0.f, 1.f, 0.f);
                 }
             }
-            break;
+            stats.faceTime += faceTimer.elapsed();
+            stats.faces += faceCount;
+
+            // -- Load materials -- //
+            if (meshPrimitive.material >= 0)
+            {
+                tinygltf::Material &mat = model.materials[meshPrimitive.material];
 
-            default:
-                std::cerr << "primitive mode not implemented";
-                break;
+                // Color
+                // Convert color to unsigned int
+                auto color = mat.pbrMetallicRoughness.baseColorFactor;
+                std::vector<uint> comp(4);
+                std::transform(std::begin(color), std::end(color), std::begin(comp), [](double val)
+                {return static_cast<uint>(val * 0xff); });
+
+                mesh.mat.color = *static_cast<Pixel*>(comp.data());
             }
 
-            std::cout << "Loaded vertices: " << mesh.faces.size() * 9 << '\n';
+            if (detail) { std::cout << "Loaded vertices: " << mesh.vertices.size() << ", faces: " << mesh.FaceCount() << '\n'; }
         }
+
+        stats.modelBytes += mesh.Memory();
     }
 
+    stats.totalTime = totalTimer.elapsed();
+    if (log != LoadLog::Silent) { stats.Print(std::cout); }
+
     /*
     // Iterate through all texture declaration in glTF file
     for (const auto& gltfTexture : model.textures) {
@@ -512,3 +377,13 @@ Model LoadGLTF(const char* path, const mat4& t)
 
     return object;
 }
+
+void LoadReport::Print(std::ostream& out) const
+{
+    out << "Load: " << faces << " faces from " << meshes << " meshes, " << primitives << " primitives";
+    if (skippedPrimitives > 0) { out << " (" << skippedPrimitives << " skipped)"; }
+    out << ", " << vertices << " vertices, " << indices << " indices\n";
+    out << "    " << fileBytes / 1e6f << " MB of buffers, " << modelBytes / 1e6f << " MB of vertices, indices and normals\n";
+    out << "    parse " << parseTime * 1000.f << " ms, indices " << indexTime * 1000.f << " ms, attributes "
+        << attributeTime * 1000.f << " ms, faces " << faceTime * 1000.f << " ms, total " << totalTime * 1000.f << " ms\n";
+}
@@ -4,4 +4,34 @@
  * Free functions to load models
  */
 
-Model LoadGLTF(const char* path, const mat4& t = mat4::Identity());
\ No newline at end of file
+// How much LoadGLTF writes to std::cout, errors always go to std::cerr
+enum class LoadLog
+{
+    Silent,
+    Summary, // The load report once the model is loaded, and parse warnings
+    Detail // Also what the file holds and every primitive as it is read
+};
+
+// What a load read and where the time went, filled at every log level
+struct LoadReport
+{
+    size_t meshes = 0;
+    size_t primitives = 0;
+    size_t skippedPrimitives = 0; // Not triangles, or without positions or indices that can be read
+    size_t vertices = 0;
+    size_t indices = 0;
+    size_t faces = 0;
+    size_t fileBytes = 0; // Buffers of the glTF file
+    size_t modelBytes = 0; // Vertices, indices and normals of the loaded model
+
+    // Seconds
+    float parseTime = 0.f; // Reading and decoding the file
+    float indexTime = 0.f;
+    float attributeTime = 0.f; // Positions and normals
+    float faceTime = 0.f; // Appending the vertices and indices to the meshes
+    float totalTime = 0.f;
+
+    void Print(std::ostream& out) const;
+};
+
+Model LoadGLTF(const char* path, const mat4& t = mat4::Identity(), LoadLog log = LoadLog::Silent, LoadReport* report = nullptr);
\ No newline at end of file
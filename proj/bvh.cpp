@@ -1,23 +1,2072 @@
 #include "precomp.h"
-#include <cstdlib>
 
-void BVHAccelerator::Build(const Model& model)
+namespace
 {
+    constexpr float REBUILD_RATIO = 1.5f; // Refitted trees this much more expensive than when built get rebuilt
 
+    constexpr size_t SORT_CHUNK = 65536; // Primitives per task of a parallel sort
+
+    constexpr int SPATIAL_BINS = 16; // Spatial splits only cost their node, so they get more planes than object splits
+    constexpr float SPATIAL_OVERLAP = 1e-5f; // Spatial splits are tried when object split children overlap this part of the root
+
+    // Bottom level leaves are filled up to what the triangle kernel tests at once
+    uint TriangleLeafSize()
+    {
+        return max(TriangleStore::Width(), BVH::MAX_LEAF_SIZE);
+    }
+
+    void BuildTriangleTree(BVH& bvh, const std::vector<aabb>& bounds, BVHBuilder builder, bool parallel)
+    {
+        if (builder == BVHBuilder::LBVH)
+        {
+            bvh.BuildLBVH(bounds, TriangleLeafSize(), parallel);
+        }
+        else
+        {
+            bvh.Build(bounds, TriangleLeafSize(), parallel);
+        }
+    }
+
+    // Spreads the lowest 21 bits of v out so there are two zeroes between every two of them
+    uint64_t ExpandBits(uint64_t v)
+    {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffull;
+        v = (v | v << 16) & 0x1f0000ff0000ffull;
+        v = (v | v << 8) & 0x100f00f00f00f00full;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
+
+    // Stable LSD radix sort of the values by key, eight bits at a time. Digits that are the same
+    // for every key are skipped, so short codes in wide keys only cost their own passes
+    void RadixSort(std::vector<uint64_t>& keys, std::vector<uint>& values, bool parallel)
+    {
+        const size_t n = keys.size();
+        const size_t chunks = parallel ? max<size_t>(1, min<size_t>(executor.num_workers() * 4, n / SORT_CHUNK)) : 1;
+        std::vector<uint64_t> keysOut(n);
+        std::vector<uint> valuesOut(n);
+        std::vector<std::array<uint, 256>> offsets(chunks);
+        auto first = [&](size_t chunk) { return n * chunk / chunks; };
+
+        for (int shift = 0; shift < 64; shift += 8)
+        {
+            auto count = [&](size_t chunk)
+            {
+                offsets[chunk].fill(0);
+                for (size_t i = first(chunk); i < first(chunk + 1); i++)
+                {
+                    offsets[chunk][(keys[i] >> shift) & 0xff]++;
+                }
+            };
+            auto scatter = [&](size_t chunk)
+            {
+                auto& offset = offsets[chunk];
+                for (size_t i = first(chunk); i < first(chunk + 1); i++)
+                {
+                    const uint dst = offset[(keys[i] >> shift) & 0xff]++;
+                    keysOut[dst] = keys[i];
+                    valuesOut[dst] = values[i];
+                }
+            };
+
+            if (chunks > 1)
+            {
+                tf::Taskflow flow;
+                for (size_t c = 0; c < chunks; c++) { flow.emplace([&, c]() { count(c); }); }
+                executor.run(flow).wait();
+            }
+            else
+            {
+                count(0);
+            }
+
+            // Every chunk writes its keys of a digit after those of the chunks before it, which keeps the sort stable
+            uint sum = 0;
+            bool isSame = false;
+            for (int digit = 0; digit < 256; digit++)
+            {
+                uint total = 0;
+                for (auto& offset : offsets)
+                {
+                    const uint c = offset[digit];
+                    offset[digit] = sum + total;
+                    total += c;
+                }
+                isSame |= total == n;
+                sum += total;
+            }
+            if (isSame) { continue; }
+
+            if (chunks > 1)
+            {
+                tf::Taskflow flow;
+                for (size_t c = 0; c < chunks; c++) { flow.emplace([&, c]() { scatter(c); }); }
+                executor.run(flow).wait();
+            }
+            else
+            {
+                scatter(0);
+            }
+
+            keys.swap(keysOut);
+            values.swap(valuesOut);
+        }
+    }
+
+    constexpr char CACHE_MAGIC[4] = { 'B', 'V', 'H', 'C' };
+    constexpr uint CACHE_VERSION = 4; // Bump when the layout of the nodes or of the cache file changes
+
+    template <typename T>
+    void WriteArray(std::ostream& out, const T* data, size_t count)
+    {
+        const uint64_t size = count;
+        out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        out.write(reinterpret_cast<const char*>(data), count * sizeof(T));
+    }
+
+    template <typename T>
+    bool ReadVector(std::istream& in, std::vector<T>& v)
+    {
+        uint64_t size = 0;
+        if (!in.read(reinterpret_cast<char*>(&size), sizeof(size))) { return false; }
+        // A damaged file can hold any size, it has to fit in what is left of it before anything is allocated
+        if (size > StreamBytesLeft(in) / sizeof(T)) { return false; }
+        v.resize(size);
+        return static_cast<bool>(in.read(reinterpret_cast<char*>(v.data()), size * sizeof(T)));
+    }
+
+    // FNV-1a over 64 bit words of everything that goes into a bottom level
+    uint64_t CacheKey(const Model& model)
+    {
+        uint64_t key = 0xcbf29ce484222325ull;
+        auto hash = [&key](const void* data, size_t size)
+        {
+            const char* bytes = static_cast<const char*>(data);
+            for (size_t i = 0; i < size; i += sizeof(uint64_t))
+            {
+                uint64_t word = 0;
+                memcpy(&word, bytes + i, min(sizeof(uint64_t), size - i));
+                key = (key ^ word) * 0x100000001b3ull;
+            }
+        };
+
+        // The leaf size follows the triangle kernel, so a cache from a machine without AVX isn't used with it
+        const uint settings[] = { CACHE_VERSION, static_cast<uint>(model.builder), TriangleLeafSize(), model.quantizedNodes,
+            static_cast<uint>(model.triangleLayout) };
+        hash(settings, sizeof(settings));
+        hash(&model.splitBudget, sizeof(model.splitBudget));
+        for (const Mesh& mesh : model.meshes)
+        {
+            const uint64_t sizes[] = { mesh.faces.size(), mesh.vertices.size(), mesh.indices.size(), mesh.normals.size() };
+            hash(sizes, sizeof(sizes));
+            hash(mesh.faces.data(), mesh.faces.size() * sizeof(mesh.faces[0]));
+            hash(mesh.vertices.data(), mesh.vertices.size() * sizeof(mesh.vertices[0]));
+            hash(mesh.indices.data(), mesh.indices.size() * sizeof(mesh.indices[0]));
+            hash(mesh.normals.data(), mesh.normals.size() * sizeof(mesh.normals[0]));
+        }
+        return key;
+    }
+
+    bool IsEmpty(const aabb& box)
+    {
+        return box.bmin[0] > box.bmax[0] || box.bmin[1] > box.bmax[1] || box.bmin[2] > box.bmax[2];
+    }
+
+    // Bounds of the part of the triangle between lo and hi along axis that lies inside box
+    aabb ClipTriangle(const std::array<float3, 3>& triangle, const aabb& box, int axis, float lo, float hi)
+    {
+        aabb clipped;
+        clipped.Reset();
+        for (int i = 0; i < 3; i++)
+        {
+            const float3& v0 = triangle[i];
+            const float3& v1 = triangle[(i + 1) % 3];
+            const float p0 = (&v0.x)[axis], p1 = (&v1.x)[axis];
+            if (p0 >= lo && p0 <= hi) { clipped.Grow(v0); }
+
+            // Where the edge crosses either plane
+            for (const float plane : { lo, hi })
+            {
+                if ((p0 < plane && p1 > plane) || (p0 > plane && p1 < plane))
+                {
+                    clipped.Grow(v0 + (v1 - v0) * ((plane - p0) / (p1 - p0)));
+                }
+            }
+        }
+
+        aabb slab = box;
+        slab.bmin[axis] = max(slab.bmin[axis], lo);
+        slab.bmax[axis] = min(slab.bmax[axis], hi);
+        return clipped.Intersection(slab);
+    }
+
+    // Object split bins count a primitive as both entering and leaving their bin,
+    // spatial split bins count where a primitive starts and where it ends
+    struct SplitBin
+    {
+        aabb bounds;
+        uint entries = 0;
+        uint exits = 0;
+    };
+
+    struct SplitCandidate
+    {
+        float cost = 1e30f;
+        int axis = -1;
+        int bin = 0; // Last bin on the left
+        aabb left, right;
+        uint leftCount = 0, rightCount = 0;
+    };
+
+    // Sweeps from both sides to get the area and count left and right of every plane
+    template <size_t N>
+    void SweepBins(const std::array<SplitBin, N>& bins, int axis, SplitCandidate& best)
+    {
+        aabb leftBoxes[N - 1], rightBoxes[N - 1];
+        uint rightCount[N - 1];
+        aabb box;
+        box.Reset();
+        uint sum = 0;
+        for (size_t i = N - 1; i > 0; i--)
+        {
+            sum += bins[i].exits;
+            box.Grow(bins[i].bounds);
+            rightCount[i - 1] = sum;
+            rightBoxes[i - 1] = box;
+        }
+
+        box.Reset();
+        sum = 0;
+        for (size_t i = 0; i < N - 1; i++)
+        {
+            sum += bins[i].entries;
+            box.Grow(bins[i].bounds);
+            leftBoxes[i] = box;
+            if (sum == 0 || rightCount[i] == 0) { continue; }
+
+            const float cost = sum * box.Area() + rightCount[i] * rightBoxes[i].Area();
+            if (cost < best.cost)
+            {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = static_cast<int>(i);
+                best.left = box;
+                best.right = rightBoxes[i];
+                best.leftCount = sum;
+                best.rightCount = rightCount[i];
+            }
+        }
+    }
+}
+
+thread_local RayStats rayStats;
+
+struct BVH::BuildState
+{
+    const std::vector<aabb>& bounds;
+    std::vector<float3> centroids;
+    std::atomic<uint> nodesUsed;
+};
+
+// Part of a triangle, spatial splits clip the bounds of the ones they cut
+struct BVH::Reference
+{
+    aabb bounds;
+    uint primIdx;
+};
+
+struct BVH::SpatialState
+{
+    const std::vector<std::array<float3, 3>>& triangles;
+    float rootArea;
+    size_t references; // Made so far, the triangles themselves included
+    size_t maxReferences;
+    uint nodesUsed;
+};
+
+void BVH::Build(const std::vector<aabb>& bounds, uint maxLeafSize, bool parallel)
+{
+    this->maxLeafSize = max(1u, maxLeafSize);
+    indices.clear();
+    tree.clear();
+    wide.clear();
+    quantized.clear();
+    nodesUsed = 0;
+
+    if (bounds.empty()) { return; }
+
+    // The split criteria only ever looks at the centroids
+    BuildState state{ bounds, std::vector<float3>(bounds.size()), { 2 } };
+    indices.resize(bounds.size());
+    aabb rootBounds, centroidBounds;
+    rootBounds.Reset();
+    centroidBounds.Reset();
+    for (uint i = 0; i < bounds.size(); i++)
+    {
+        state.centroids[i] = (bounds[i].bmin3 + bounds[i].bmax3) * 0.5f;
+        indices[i] = i;
+        rootBounds.Grow(bounds[i]);
+        centroidBounds.Grow(state.centroids[i]);
+    }
+
+    // A binary tree never has more than 2N - 1 nodes, node 1 is left empty to align siblings
+    tree.resize(bounds.size() * 2);
+    BVHNode& root = tree[0];
+    root.leftFirst = 0;
+    root.count = static_cast<uint>(bounds.size());
+    root.bmin = rootBounds.bmin3;
+    root.bmax = rootBounds.bmax3;
+
+    if (parallel && bounds.size() > PARALLEL_SUBTREE)
+    {
+        tf::Taskflow flow;
+        flow.emplace([&](tf::Subflow& subflow) { Subdivide(0, centroidBounds, state, &subflow); });
+        executor.run(flow).wait();
+    }
+    else
+    {
+        Subdivide(0, centroidBounds, state, nullptr);
+    }
+
+    nodesUsed = state.nodesUsed;
+    buildCost = Cost();
+    Collapse();
+}
+
+void BVH::BuildLBVH(const std::vector<aabb>& bounds, uint maxLeafSize, bool parallel)
+{
+    this->maxLeafSize = max(1u, maxLeafSize);
+    indices.clear();
+    tree.clear();
+    wide.clear();
+    quantized.clear();
+    nodesUsed = 0;
+
+    if (bounds.empty()) { return; }
+
+    aabb centroidBounds;
+    centroidBounds.Reset();
+    for (const auto& box : bounds)
+    {
+        centroidBounds.Grow((box.bmin3 + box.bmax3) * 0.5f);
+    }
+
+    // 10 bits per axis fit 30 bit codes, large models get 21 per axis so fewer triangles share a code
+    const int bits = bounds.size() > (1u << 20) ? 21 : 10;
+    const float cells = static_cast<float>((1u << bits) - 1);
+    const float3 extent = centroidBounds.bmax3 - centroidBounds.bmin3;
+    const float3 scale = make_float3(
+        extent.x > 0.f ? cells / extent.x : 0.f,
+        extent.y > 0.f ? cells / extent.y : 0.f,
+        extent.z > 0.f ? cells / extent.z : 0.f);
+
+    std::vector<uint64_t> codes(bounds.size());
+    indices.resize(bounds.size());
+    for (uint i = 0; i < bounds.size(); i++)
+    {
+        const float3 cell = ((bounds[i].bmin3 + bounds[i].bmax3) * 0.5f - centroidBounds.bmin3) * scale;
+        codes[i] = ExpandBits(static_cast<uint64_t>(cell.x)) << 2
+            | ExpandBits(static_cast<uint64_t>(cell.y)) << 1
+            | ExpandBits(static_cast<uint64_t>(cell.z));
+        indices[i] = i;
+    }
+    RadixSort(codes, indices, parallel);
+
+    tree.resize(bounds.size() * 2);
+    BVHNode& root = tree[0];
+    root.leftFirst = 0;
+    root.count = static_cast<uint>(bounds.size());
+    std::atomic<uint> used{ 2 };
+
+    if (parallel && bounds.size() > PARALLEL_SUBTREE)
+    {
+        tf::Taskflow flow;
+        flow.emplace([&](tf::Subflow& subflow) { EmitLBVH(0, codes, used, &subflow); });
+        executor.run(flow).wait();
+    }
+    else
+    {
+        EmitLBVH(0, codes, used, nullptr);
+    }
+    nodesUsed = used;
+
+    // The splits never looked at the bounds, fill them in bottom-up
+    Refit(bounds);
+    buildCost = Cost();
+}
+
+void BVH::EmitLBVH(uint nodeIdx, const std::vector<uint64_t>& codes, std::atomic<uint>& used, tf::Subflow* subflow)
+{
+    BVHNode& node = tree[nodeIdx];
+    if (node.count <= maxLeafSize) { return; }
+
+    const uint first = node.leftFirst;
+    const uint last = first + node.count - 1;
+
+    // Everything before the first code with the highest differing bit set goes left,
+    // identical codes are split in the middle
+    uint split = first + node.count / 2;
+    const uint64_t diff = codes[first] ^ codes[last];
+    if (diff != 0)
+    {
+        uint64_t bit = 1ull << 63;
+        while (!(diff & bit)) { bit >>= 1; }
+
+        uint lo = first, hi = last;
+        while (lo < hi)
+        {
+            const uint mid = (lo + hi) / 2;
+            if (codes[mid] & bit) { hi = mid; }
+            else { lo = mid + 1; }
+        }
+        split = lo;
+    }
+
+    const uint leftIdx = used.fetch_add(2);
+    tree[leftIdx].leftFirst = first;
+    tree[leftIdx].count = split - first;
+    tree[leftIdx + 1].leftFirst = split;
+    tree[leftIdx + 1].count = last + 1 - split;
+    node.leftFirst = leftIdx;
+    node.count = 0;
+
+    for (const uint child : { leftIdx, leftIdx + 1 })
+    {
+        if (subflow && tree[child].count > PARALLEL_SUBTREE)
+        {
+            subflow->emplace([this, child, &codes, &used](tf::Subflow& sf) { EmitLBVH(child, codes, used, &sf); });
+        }
+        else
+        {
+            EmitLBVH(child, codes, used, nullptr);
+        }
+    }
+}
+
+void BVH::BuildSBVH(const std::vector<std::array<float3, 3>>& triangles, uint maxLeafSize, float budget)
+{
+    this->maxLeafSize = max(1u, maxLeafSize);
+    indices.clear();
+    tree.clear();
+    wide.clear();
+    quantized.clear();
+    nodesUsed = 0;
+
+    if (triangles.empty()) { return; }
+
+    std::vector<Reference> refs(triangles.size());
+    aabb rootBounds;
+    rootBounds.Reset();
+    for (uint i = 0; i < triangles.size(); i++)
+    {
+        refs[i].bounds.Reset();
+        for (const float3& v : triangles[i]) { refs[i].bounds.Grow(v); }
+        refs[i].primIdx = i;
+        rootBounds.Grow(refs[i].bounds);
+    }
+
+    const size_t maxReferences = triangles.size() + static_cast<size_t>(max(0.f, budget) * triangles.size());
+    SpatialState state{ triangles, rootBounds.Area(), triangles.size(), maxReferences, 2 };
+
+    // Every leaf holds a reference, so there are fewer than two nodes per reference
+    tree.resize(maxReferences * 2);
+    indices.reserve(maxReferences);
+    SubdivideSBVH(0, std::move(refs), state);
+
+    nodesUsed = state.nodesUsed;
+    buildCost = Cost();
+    Collapse();
+}
+
+void BVH::SubdivideSBVH(uint nodeIdx, std::vector<Reference> refs, SpatialState& state)
+{
+    aabb bounds, centroidBounds;
+    bounds.Reset();
+    centroidBounds.Reset();
+    for (const Reference& ref : refs)
+    {
+        bounds.Grow(ref.bounds);
+        centroidBounds.Grow(ref.bounds.Center());
+    }
+
+    BVHNode& node = tree[nodeIdx];
+    node.bmin = bounds.bmin3;
+    node.bmax = bounds.bmax3;
+
+    std::vector<Reference> left, right;
+    if (refs.size() > maxLeafSize)
+    {
+        // Binned object split over the centroids, the same as Build
+        SplitCandidate object;
+        for (int a = 0; a < 3; a++)
+        {
+            const float cmin = centroidBounds.Minimum(a);
+            const float extent = centroidBounds.Extend(a);
+            if (extent <= 0.f) { continue; }
+
+            std::array<SplitBin, BINS> bins;
+            const float scale = BINS / extent;
+            for (const Reference& ref : refs)
+            {
+                SplitBin& bin = bins[min(BINS - 1, static_cast<int>((ref.bounds.Center(a) - cmin) * scale))];
+                bin.entries++;
+                bin.exits++;
+                bin.bounds.Grow(ref.bounds);
+            }
+            SweepBins(bins, a, object);
+        }
+
+        // Only where the children of the object split overlap a lot can splitting space do better
+        SplitCandidate spatial;
+        const aabb overlap = object.left.Intersection(object.right);
+        const bool hasBudget = state.references < state.maxReferences;
+        if (hasBudget && (object.axis == -1 || (!IsEmpty(overlap) && overlap.Area() > SPATIAL_OVERLAP * state.rootArea)))
+        {
+            for (int a = 0; a < 3; a++)
+            {
+                const float lo = bounds.Minimum(a);
+                const float extent = bounds.Extend(a);
+                if (extent <= 0.f) { continue; }
+
+                // Every reference adds its clipped part to each bin it covers
+                std::array<SplitBin, SPATIAL_BINS> bins;
+                const float scale = SPATIAL_BINS / extent;
+                for (const Reference& ref : refs)
+                {
+                    const int first = clamp(static_cast<int>((ref.bounds.Minimum(a) - lo) * scale), 0, SPATIAL_BINS - 1);
+                    const int last = clamp(static_cast<int>((ref.bounds.Maximum(a) - lo) * scale), first, SPATIAL_BINS - 1);
+                    bins[first].entries++;
+                    bins[last].exits++;
+                    for (int b = first; b <= last; b++)
+                    {
+                        const float planeLo = lo + b / scale;
+                        const float planeHi = b == SPATIAL_BINS - 1 ? bounds.Maximum(a) : lo + (b + 1) / scale;
+                        bins[b].bounds.Grow(ClipTriangle(state.triangles[ref.primIdx], ref.bounds, a, planeLo, planeHi));
+                    }
+                }
+                SweepBins(bins, a, spatial);
+            }
+        }
+
+        // Clipped parts that all span their node make leaves look cheap, so only spatial splits have to beat
+        // a leaf. Nodes that are too big always get at least the object split, which can't duplicate anything
+        const float leafCost = refs.size() * bounds.Area();
+        const size_t duplicates = spatial.leftCount + spatial.rightCount - refs.size();
+        if (spatial.axis != -1 && spatial.cost < object.cost && spatial.cost < leafCost
+            && state.references + duplicates <= state.maxReferences)
+        {
+            const int a = spatial.axis;
+            const float lo = bounds.Minimum(a);
+            const float scale = SPATIAL_BINS / bounds.Extend(a);
+            const float plane = lo + (spatial.bin + 1) / scale;
+            float leftArea = spatial.left.Area(), rightArea = spatial.right.Area();
+            uint leftCount = spatial.leftCount, rightCount = spatial.rightCount;
+            for (const Reference& ref : refs)
+            {
+                const int first = clamp(static_cast<int>((ref.bounds.Minimum(a) - lo) * scale), 0, SPATIAL_BINS - 1);
+                const int last = clamp(static_cast<int>((ref.bounds.Maximum(a) - lo) * scale), first, SPATIAL_BINS - 1);
+                if (last <= spatial.bin) { left.push_back(ref); continue; }
+                if (first > spatial.bin) { right.push_back(ref); continue; }
+
+                // Keeping a straddling reference whole on one side can be cheaper than having it on both
+                const aabb leftGrown = aabb::Union(spatial.left, ref.bounds);
+                const aabb rightGrown = aabb::Union(spatial.right, ref.bounds);
+                const float splitCost = leftArea * leftCount + rightArea * rightCount;
+                const float leftOnly = leftGrown.Area() * leftCount + rightArea * (rightCount - 1);
+                const float rightOnly = leftArea * (leftCount - 1) + rightGrown.Area() * rightCount;
+
+                Reference leftPart{ ClipTriangle(state.triangles[ref.primIdx], ref.bounds, a, ref.bounds.Minimum(a), plane), ref.primIdx };
+                Reference rightPart{ ClipTriangle(state.triangles[ref.primIdx], ref.bounds, a, plane, ref.bounds.Maximum(a)), ref.primIdx };
+                if ((leftOnly < splitCost && leftOnly <= rightOnly) || IsEmpty(rightPart.bounds))
+                {
+                    left.push_back(ref);
+                    spatial.left = leftGrown;
+                    leftArea = leftGrown.Area();
+                    rightCount--;
+                }
+                else if (rightOnly < splitCost || IsEmpty(leftPart.bounds))
+                {
+                    right.push_back(ref);
+                    spatial.right = rightGrown;
+                    rightArea = rightGrown.Area();
+                    leftCount--;
+                }
+                else
+                {
+                    left.push_back(leftPart);
+                    right.push_back(rightPart);
+                }
+            }
+            state.references += left.size() + right.size() - refs.size();
+        }
+        else if (object.axis != -1)
+        {
+            const int a = object.axis;
+            const float cmin = centroidBounds.Minimum(a);
+            const float scale = BINS / centroidBounds.Extend(a);
+            for (const Reference& ref : refs)
+            {
+                const int binIdx = min(BINS - 1, static_cast<int>((ref.bounds.Center(a) - cmin) * scale));
+                (binIdx <= object.bin ? left : right).push_back(ref);
+            }
+        }
+    }
+
+    if (left.empty() || right.empty())
+    {
+        node.leftFirst = static_cast<uint>(indices.size());
+        node.count = static_cast<uint>(refs.size());
+        for (const Reference& ref : refs) { indices.push_back(ref.primIdx); }
+        return;
+    }
+
+    // Children are always allocated after their parent, refitting relies on it
+    const uint leftIdx = state.nodesUsed;
+    state.nodesUsed += 2;
+    node.leftFirst = leftIdx;
+    node.count = 0;
+    refs.clear();
+    refs.shrink_to_fit();
+    SubdivideSBVH(leftIdx, std::move(left), state);
+    SubdivideSBVH(leftIdx + 1, std::move(right), state);
+}
+
+void BVH::Refit(const std::vector<aabb>& bounds)
+{
+    Refit([&bounds](aabb& box, uint primIdx) { box.Grow(bounds[primIdx]); });
+}
+
+void BVH::Collapse()
+{
+    wide.clear();
+    quantized.clear();
+    freeWide.clear();
+    patchedWide = 0;
+    if (nodesUsed == 0) { return; }
+
+    if (trackWide)
+    {
+        wideOf.assign(tree.size(), EMPTY_SLOT);
+        wideSlot.assign(tree.size(), EMPTY_SLOT);
+    }
+
+    // Every wide node takes the place of at least one binary inner node
+    wide.reserve(nodesUsed / 2 + 1);
+    CollapseNode(0);
+    patchedWide = 0;
+
+    if (quantize) { Quantize(); }
+
+    const std::vector<uint> position = quantize ? Reorder(quantized) : Reorder(wide);
+    if (!position.empty())
+    {
+        for (uint& w : wideOf)
+        {
+            if (w != EMPTY_SLOT) { w = position[w]; }
+        }
+        for (uint& slot : wideSlot)
+        {
+            if (slot != EMPTY_SLOT) { slot = position[slot / 4] * 4 + slot % 4; }
+        }
+    }
+}
+
+uint BVH::CollapseNode(uint nodeIdx, uint wideIdx)
+{
+    // Subtrees an update left alone keep their wide nodes
+    if (trackWide && wideIdx == EMPTY_SLOT && wideOf[nodeIdx] != EMPTY_SLOT) { return wideOf[nodeIdx]; }
+
+    // Keep opening the biggest inner child until there are four, those are the ones most rays enter.
+    // A root that is a leaf becomes the only child of the root
+    uint children[4] = { nodeIdx };
+    uint childCount = 1;
+    while (childCount < 4)
+    {
+        int best = -1;
+        float bestArea = -1.f;
+        for (uint i = 0; i < childCount; i++)
+        {
+            const BVHNode& child = tree[children[i]];
+            if (!child.IsLeaf() && child.Area() > bestArea)
+            {
+                best = i;
+                bestArea = child.Area();
+            }
+        }
+        if (best == -1) { break; }
+
+        // Opened nodes are part of this wide node, whatever they were part of before
+        if (trackWide && children[best] != nodeIdx)
+        {
+            FreeWide(children[best]);
+            wideSlot[children[best]] = EMPTY_SLOT;
+        }
+
+        const uint opened = tree[children[best]].leftFirst;
+        children[best] = opened;
+        children[childCount++] = opened + 1;
+    }
+
+    // Allocated before the children so the root ends up at 0, the vector may grow while they are collapsed
+    if (wideIdx == EMPTY_SLOT && !freeWide.empty())
+    {
+        wideIdx = freeWide.back();
+        freeWide.pop_back();
+        patchedWide++;
+    }
+    else if (wideIdx == EMPTY_SLOT)
+    {
+        wideIdx = static_cast<uint>(wide.size());
+        wide.emplace_back();
+        if (trackWide) { patchedWide++; }
+    }
+
+    uint child[4], count[4];
+    for (uint i = 0; i < childCount; i++)
+    {
+        const BVHNode& node = tree[children[i]];
+        child[i] = node.IsLeaf() ? node.leftFirst : CollapseNode(children[i]);
+        count[i] = node.count;
+    }
+
+    // Empty slots get a box at infinity, which no ray can reach before its tMax
+    const float inf = std::numeric_limits<float>::infinity();
+    WideNode& wideNode = wide[wideIdx];
+    for (uint i = 0; i < 4; i++)
+    {
+        const bool used = i < childCount;
+        const BVHNode& node = tree[children[used ? i : 0]];
+        for (int a = 0; a < 3; a++)
+        {
+            wideNode.bmin[a][i] = used ? (&node.bmin.x)[a] : inf;
+            wideNode.bmax[a][i] = used ? (&node.bmax.x)[a] : inf;
+        }
+        wideNode.child[i] = used ? child[i] : EMPTY_SLOT;
+        wideNode.count[i] = used ? count[i] : 0;
+        if (trackWide && used) { wideSlot[children[i]] = wideIdx * 4 + i; }
+    }
+
+    if (trackWide) { wideOf[nodeIdx] = wideIdx; }
+    return wideIdx;
+}
+
+void BVH::FreeWide(uint nodeIdx)
+{
+    if (wideOf[nodeIdx] == EMPTY_SLOT) { return; }
+
+    freeWide.push_back(wideOf[nodeIdx]);
+    wideOf[nodeIdx] = EMPTY_SLOT;
+}
+
+void BVH::Quantize()
+{
+    // Decoded the same way as during traversal, so the rounding below is checked against what a ray sees
+    auto decode = [](uint q, float origin, float scale)
+    {
+        return _mm_cvtss_f32(_mm_add_ss(_mm_set_ss(origin), _mm_mul_ss(_mm_set_ss(static_cast<float>(q)), _mm_set_ss(scale))));
+    };
+
+    quantized.resize(wide.size());
+    for (size_t n = 0; n < wide.size(); n++)
+    {
+        const WideNode& node = wide[n];
+        QuantizedNode& q = quantized[n];
+
+        uint childCount = 0;
+        while (childCount < 4 && node.child[childCount] != EMPTY_SLOT) { childCount++; }
+
+        for (int a = 0; a < 3; a++)
+        {
+            float lo = node.bmin[a][0], hi = node.bmax[a][0];
+            for (uint i = 1; i < childCount; i++)
+            {
+                lo = min(lo, node.bmin[a][i]);
+                hi = max(hi, node.bmax[a][i]);
+            }
+
+            // Rounding can leave the last step short of the node bounds
+            float scale = (hi - lo) / 255.f;
+            while (decode(255, lo, scale) < hi) { scale = nextafterf(scale, 1e30f); }
+            (&q.origin.x)[a] = lo;
+            (&q.scale.x)[a] = scale;
+
+            for (uint i = 0; i < 4; i++)
+            {
+                if (i >= childCount || scale == 0.f)
+                {
+                    q.qmin[a][i] = q.qmax[a][i] = 0;
+                    continue;
+                }
+
+                int qmin = clamp(static_cast<int>(floorf((node.bmin[a][i] - lo) / scale)), 0, 255);
+                int qmax = clamp(static_cast<int>(ceilf((node.bmax[a][i] - lo) / scale)), 0, 255);
+                while (qmin > 0 && decode(qmin, lo, scale) > node.bmin[a][i]) { qmin--; }
+                while (qmax < 255 && decode(qmax, lo, scale) < node.bmax[a][i]) { qmax++; }
+                q.qmin[a][i] = static_cast<uint8_t>(qmin);
+                q.qmax[a][i] = static_cast<uint8_t>(qmax);
+            }
+        }
+
+        for (uint i = 0; i < 4; i++)
+        {
+            q.child[i] = node.child[i];
+            q.count[i] = node.count[i];
+        }
+    }
+
+    wide.clear();
+    wide.shrink_to_fit();
+}
+
+template <typename Node>
+std::vector<uint> BVH::Reorder(std::vector<Node>& nodes) const
+{
+    // Wide nodes of the inner children, leaves and empty slots have no node of their own
+    auto children = [&nodes](uint n, uint* out)
+    {
+        uint count = 0;
+        for (uint i = 0; i < 4; i++)
+        {
+            if (nodes[n].count[i] == 0 && nodes[n].child[i] != EMPTY_SLOT) { out[count++] = nodes[n].child[i]; }
+        }
+        return count;
+    };
+
+    std::vector<uint> order; // Old index of every new position
+    order.reserve(nodes.size());
+    uint inner[4];
+
+    if (layout == NodeLayout::BreadthFirst)
+    {
+        order.push_back(0);
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            const uint count = children(order[i], inner);
+            order.insert(order.end(), inner, inner + count);
+        }
+    }
+    else if (layout == NodeLayout::Treelet)
+    {
+        // The nodes left over when a treelet is full start treelets of their own, depth-first
+        const size_t treeletSize = max<size_t>(1, 4096 / sizeof(Node));
+        std::vector<uint> roots = { 0 };
+        std::deque<uint> frontier;
+        while (!roots.empty())
+        {
+            frontier.assign(1, roots.back());
+            roots.pop_back();
+            for (size_t size = 0; size < treeletSize && !frontier.empty(); size++)
+            {
+                const uint n = frontier.front();
+                frontier.pop_front();
+                order.push_back(n);
+
+                const uint count = children(n, inner);
+                frontier.insert(frontier.end(), inner, inner + count);
+            }
+            roots.insert(roots.end(), frontier.rbegin(), frontier.rend());
+        }
+    }
+    else if (layout == NodeLayout::VanEmdeBoas)
+    {
+        // Children come after their parent, so going backwards gives every subtree its height
+        std::vector<uint> height(nodes.size(), 1);
+        for (size_t n = nodes.size(); n-- > 0;)
+        {
+            const uint count = children(static_cast<uint>(n), inner);
+            for (uint i = 0; i < count; i++)
+            {
+                height[n] = max(height[n], height[inner[i]] + 1);
+            }
+        }
+
+        // Lays out the first levels of the subtree at root
+        std::function<void(uint, uint)> layOut = [&](uint root, uint levels)
+        {
+            if (levels == 1)
+            {
+                order.push_back(root);
+                return;
+            }
+
+            const uint top = levels / 2;
+            layOut(root, top);
+
+            // The subtrees hanging below the top levels follow one after the other
+            std::vector<uint> level = { root };
+            for (uint depth = 0; depth < top; depth++)
+            {
+                std::vector<uint> next;
+                for (const uint n : level)
+                {
+                    const uint count = children(n, inner);
+                    next.insert(next.end(), inner, inner + count);
+                }
+                level.swap(next);
+            }
+            for (const uint n : level)
+            {
+                layOut(n, levels - top);
+            }
+        };
+        layOut(0, height[0]);
+    }
+    else
+    {
+        return {};
+    }
+
+    std::vector<uint> position(nodes.size());
+    for (uint i = 0; i < order.size(); i++)
+    {
+        position[order[i]] = i;
+    }
+
+    std::vector<Node> reordered(nodes.size());
+    for (uint i = 0; i < order.size(); i++)
+    {
+        Node& node = reordered[i];
+        node = nodes[order[i]];
+        for (uint c = 0; c < 4; c++)
+        {
+            if (node.count[c] == 0 && node.child[c] != EMPTY_SLOT) { node.child[c] = position[node.child[c]]; }
+        }
+    }
+    nodes.swap(reordered);
+    return position;
+}
+
+void BVH::SetLayout(NodeLayout layout)
+{
+    if (this->layout == layout) { return; }
+
+    this->layout = layout;
+    Collapse();
+}
+
+void BVH::SetQuantized(bool quantize)
+{
+    if (this->quantize == quantize) { return; }
+
+    this->quantize = quantize;
+    Collapse();
+}
+
+float BVH::Cost() const
+{
+    if (nodesUsed == 0) { return 0.f; }
+
+    const float rootArea = tree[0].Area();
+    if (rootArea <= 0.f) { return 0.f; }
+
+    float cost = 0.f;
+    for (uint i = 0; i < nodesUsed; i++)
+    {
+        if (i != 1) { cost += tree[i].Cost(); }
+    }
+
+    return cost / rootArea;
+}
+
+bool BVH::IsDegraded() const
+{
+    return buildCost > 0.f && Cost() > buildCost * REBUILD_RATIO;
+}
+
+void BVH::BinPrimitives(uint first, uint count, const aabb& centroidBounds, const BuildState& state, Bins& bins) const
+{
+    for (int a = 0; a < 3; a++)
+    {
+        for (auto& bin : bins[a])
+        {
+            bin.bounds.Reset();
+            bin.count = 0;
+        }
+
+        const float cmin = centroidBounds.Minimum(a);
+        const float extent = centroidBounds.Maximum(a) - cmin;
+        if (extent <= 0.f) { continue; }
+
+        const float scale = BINS / extent;
+        for (uint i = first; i < first + count; i++)
+        {
+            const uint primIdx = indices[i];
+            const int binIdx = min(BINS - 1, static_cast<int>(((&state.centroids[primIdx].x)[a] - cmin) * scale));
+            bins[a][binIdx].count++;
+            bins[a][binIdx].bounds.Grow(state.bounds[primIdx]);
+        }
+    }
+}
+
+void BVH::Subdivide(uint nodeIdx, const aabb& centroidBounds, BuildState& state, tf::Subflow* subflow)
+{
+    const BVHNode& node = tree[nodeIdx];
+    if (node.count <= maxLeafSize) { return; }
+
+    if (subflow && node.count > PARALLEL_BINNING)
+    {
+        // Bin chunks of the primitives side by side, the split waits for all of them
+        const uint chunkSize = PARALLEL_BINNING / 4;
+        const uint chunks = (node.count + chunkSize - 1) / chunkSize;
+        auto chunkBins = std::make_shared<std::vector<Bins>>(chunks);
+
+        tf::Task split = subflow->emplace([this, nodeIdx, centroidBounds, chunkBins, &state](tf::Subflow& sf)
+        {
+            Bins bins = (*chunkBins)[0];
+            for (size_t c = 1; c < chunkBins->size(); c++)
+            {
+                for (int a = 0; a < 3; a++)
+                {
+                    for (int b = 0; b < BINS; b++)
+                    {
+                        bins[a][b].bounds.Grow((*chunkBins)[c][a][b].bounds);
+                        bins[a][b].count += (*chunkBins)[c][a][b].count;
+                    }
+                }
+            }
+            Split(nodeIdx, centroidBounds, bins, state, &sf);
+        });
+
+        for (uint c = 0; c < chunks; c++)
+        {
+            const uint first = node.leftFirst + c * chunkSize;
+            const uint count = min(chunkSize, node.leftFirst + node.count - first);
+            subflow->emplace([this, first, count, centroidBounds, chunkBins, c, &state]()
+            {
+                BinPrimitives(first, count, centroidBounds, state, (*chunkBins)[c]);
+            }).precede(split);
+        }
+        return;
+    }
+
+    Bins bins;
+    BinPrimitives(node.leftFirst, node.count, centroidBounds, state, bins);
+    Split(nodeIdx, centroidBounds, bins, state, subflow);
+}
+
+void BVH::Split(uint nodeIdx, const aabb& centroidBounds, const Bins& bins, BuildState& state, tf::Subflow* subflow)
+{
+    BVHNode& node = tree[nodeIdx];
+
+    // Sweep from both sides to get the area and count left and right of every plane
+    float bestCost = 1e30f;
+    int axis = -1, splitBin = 0;
+    for (int a = 0; a < 3; a++)
+    {
+        if (centroidBounds.Maximum(a) <= centroidBounds.Minimum(a)) { continue; }
+
+        float leftArea[BINS - 1], rightArea[BINS - 1];
+        uint leftCount[BINS - 1], rightCount[BINS - 1];
+        aabb leftBox, rightBox;
+        leftBox.Reset();
+        rightBox.Reset();
+        uint leftSum = 0, rightSum = 0;
+        for (int i = 0; i < BINS - 1; i++)
+        {
+            leftSum += bins[a][i].count;
+            leftCount[i] = leftSum;
+            leftBox.Grow(bins[a][i].bounds);
+            leftArea[i] = leftBox.Area();
+
+            rightSum += bins[a][BINS - 1 - i].count;
+            rightCount[BINS - 2 - i] = rightSum;
+            rightBox.Grow(bins[a][BINS - 1 - i].bounds);
+            rightArea[BINS - 2 - i] = rightBox.Area();
+        }
+
+        for (int i = 0; i < BINS - 1; i++)
+        {
+            const float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                axis = a;
+                splitBin = i;
+            }
+        }
+    }
+
+    // Only split when it is cheaper than intersecting everything in this node
+    const float leafCost = node.count * node.Area();
+    if (axis == -1 || bestCost >= leafCost) { return; }
+
+    // Partition the indices in place with the same bin index as the binning,
+    // so the bins describe the children exactly
+    const float cmin = centroidBounds.Minimum(axis);
+    const float scale = BINS / (centroidBounds.Maximum(axis) - cmin);
+    aabb leftCentroids, rightCentroids;
+    leftCentroids.Reset();
+    rightCentroids.Reset();
+    int i = node.leftFirst;
+    int j = i + node.count - 1;
+    while (i <= j)
+    {
+        const float3& c = state.centroids[indices[i]];
+        const int binIdx = min(BINS - 1, static_cast<int>(((&c.x)[axis] - cmin) * scale));
+        if (binIdx <= splitBin)
+        {
+            leftCentroids.Grow(c);
+            i++;
+        }
+        else
+        {
+            rightCentroids.Grow(c);
+            std::swap(indices[i], indices[j--]);
+        }
+    }
+
+    const uint leftCount = i - node.leftFirst;
+    if (leftCount == 0 || leftCount == node.count) { return; }
+
+    aabb leftBounds, rightBounds;
+    leftBounds.Reset();
+    rightBounds.Reset();
+    for (int b = 0; b < BINS; b++)
+    {
+        (b <= splitBin ? leftBounds : rightBounds).Grow(bins[axis][b].bounds);
+    }
+
+    // Children are always allocated after their parent, refitting relies on it
+    const uint leftIdx = state.nodesUsed.fetch_add(2);
+    BVHNode& left = tree[leftIdx];
+    BVHNode& right = tree[leftIdx + 1];
+    left.leftFirst = node.leftFirst;
+    left.count = leftCount;
+    left.bmin = leftBounds.bmin3;
+    left.bmax = leftBounds.bmax3;
+    right.leftFirst = i;
+    right.count = node.count - leftCount;
+    right.bmin = rightBounds.bmin3;
+    right.bmax = rightBounds.bmax3;
+    node.leftFirst = leftIdx;
+    node.count = 0;
+
+    // Big subtrees become tasks of their own, small ones are built by this task
+    for (const uint child : { leftIdx, leftIdx + 1 })
+    {
+        const aabb& childCentroids = child == leftIdx ? leftCentroids : rightCentroids;
+        if (subflow && tree[child].count > PARALLEL_SUBTREE)
+        {
+            subflow->emplace([this, child, childCentroids, &state](tf::Subflow& sf)
+            {
+                Subdivide(child, childCentroids, state, &sf);
+            });
+        }
+        else
+        {
+            Subdivide(child, childCentroids, state, nullptr);
+        }
+    }
+}
+
+aabb BVH::Bounds() const
+{
+    if (nodesUsed == 0) { return aabb(make_float3(0.f), make_float3(0.f)); }
+    return aabb(tree[0].bmin, tree[0].bmax);
+}
+
+size_t BVH::NodeCount() const
+{
+    return nodesUsed;
+}
+
+BVHMemory BVH::Memory() const
+{
+    const size_t wideCount = quantize ? quantized.size() : wide.size();
+
+    BVHMemory memory;
+    memory.binary = tree.size() * sizeof(BVHNode) + indices.size() * sizeof(uint);
+    memory.wide = wideCount * sizeof(WideNode);
+    memory.quantized = wideCount * sizeof(QuantizedNode);
+    memory.isQuantized = quantize;
+    return memory;
+}
+
+void BVH::Write(std::ostream& out) const
+{
+    out.write(reinterpret_cast<const char*>(&maxLeafSize), sizeof(maxLeafSize));
+    out.write(reinterpret_cast<const char*>(&buildCost), sizeof(buildCost));
+    out.write(reinterpret_cast<const char*>(&quantize), sizeof(quantize));
+    WriteArray(out, indices.data(), indices.size());
+    WriteArray(out, tree.data(), nodesUsed);
+    WriteArray(out, wide.data(), wide.size());
+    WriteArray(out, quantized.data(), quantized.size());
+}
+
+bool BVH::Read(std::istream& in)
+{
+    in.read(reinterpret_cast<char*>(&maxLeafSize), sizeof(maxLeafSize));
+    in.read(reinterpret_cast<char*>(&buildCost), sizeof(buildCost));
+    in.read(reinterpret_cast<char*>(&quantize), sizeof(quantize));
+    if (!in || !ReadVector(in, indices) || !ReadVector(in, tree) || !ReadVector(in, wide) || !ReadVector(in, quantized))
+    {
+        return false;
+    }
+
+    nodesUsed = static_cast<uint>(tree.size());
+    return true;
+}
+
+BVHMemory& BVHMemory::operator+=(const BVHMemory& other)
+{
+    binary += other.binary;
+    wide += other.wide;
+    quantized += other.quantized;
+    triangles += other.triangles;
+    isQuantized |= other.isQuantized;
+    return *this;
+}
+
+void BottomLevelBVH::Build(const Model& model, bool parallel)
+{
     // Get all primitives
-    float3 min = make_float3(std::numeric_limits<float>::max());
-    float3 max = make_float3(std::numeric_limits<float>::min());
-    
-    for (const auto& mesh : model.meshes)
+    std::vector<uint2> order;
+    std::vector<aabb> bounds;
+    for (uint meshIdx = 0; meshIdx < model.meshes.size(); meshIdx++)
+    {
+        const Mesh& mesh = model.meshes[meshIdx];
+        for (uint i = 0; i < mesh.FaceCount(); i++)
+        {
+            order.push_back(make_uint2(meshIdx, i));
+
+            const auto face = mesh.Face(i);
+            aabb box;
+            box.Reset();
+            box.Grow(face[0]);
+            box.Grow(face[1]);
+            box.Grow(face[2]);
+            bounds.push_back(box);
+        }
+    }
+
+    quantize = model.quantizedNodes;
+    if (model.builder == BVHBuilder::SBVH)
+    {
+        // Spatial splits clip the triangles themselves, their bounds aren't enough
+        std::vector<std::array<float3, 3>> faces;
+        faces.reserve(order.size());
+        for (const uint2& source : order)
+        {
+            faces.push_back(model.meshes[source.x].Face(source.y));
+        }
+        BuildSBVH(faces, TriangleLeafSize(), model.splitBudget);
+    }
+    else
+    {
+        BuildTriangleTree(*this, bounds, model.builder, parallel);
+    }
+    Pack(model, order);
+}
+
+void BottomLevelBVH::Refit(const Model& model)
+{
+    triangles.Update(model);
+    RefitToTriangles();
+}
+
+void BottomLevelBVH::Adopt(BVH&& bvh, const Model& model)
+{
+    // The new tree indexes the triangles in their current order
+    std::vector<uint2> order(triangles.Size());
+    for (uint i = 0; i < order.size(); i++)
     {
+        order[i] = triangles.Source(i);
     }
 
-    // Calculate world bounds
+    const NodeLayout currentLayout = layout;
+    static_cast<BVH&>(*this) = std::move(bvh);
+    quantize = model.quantizedNodes;
+    layout = currentLayout;
+    Pack(model, order);
+    RefitToTriangles();
+}
+
+bool BottomLevelBVH::ReadCache(const Model& model)
+{
+    if (model.cachePath.empty()) { return false; }
+
+    std::ifstream in(model.cachePath, std::ios::binary);
+    if (!in) { return false; }
+
+    char magic[sizeof(CACHE_MAGIC)];
+    uint64_t key = 0;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char*>(&key), sizeof(key));
+    if (!in || memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 || key != CacheKey(model)) { return false; }
 
+    // A file that ends early leaves this half read, the caller builds it from scratch then
+    return Read(in) && triangles.Read(in, model);
+}
 
-    // Use split criteria
+void BottomLevelBVH::WriteCache(const Model& model) const
+{
+    if (model.cachePath.empty()) { return; }
+
+    std::ofstream out(model.cachePath, std::ios::binary | std::ios::trunc);
+    const uint64_t key = CacheKey(model);
+    out.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    out.write(reinterpret_cast<const char*>(&key), sizeof(key));
+    Write(out);
+    triangles.Write(out);
+
+    if (!out)
+    {
+        std::cout << "Failed to write BVH cache " << model.cachePath << '\n';
+    }
+}
 
-    // Build left most till leaf
+void BottomLevelBVH::Pack(const Model& model, const std::vector<uint2>& order)
+{
+    // Store the triangles in leaf order so every leaf reads one contiguous range
+    std::vector<uint2> sorted(indices.size());
+    for (uint i = 0; i < indices.size(); i++)
+    {
+        sorted[i] = order[indices[i]];
+        indices[i] = i;
+    }
+
+    triangles.Build(model, std::move(sorted));
+}
+
+void BottomLevelBVH::RefitToTriangles()
+{
+    BVH::Refit([&](aabb& box, uint triIdx)
+    {
+        const float3 v0 = triangles.Vertex0(triIdx);
+        box.Grow(v0);
+        box.Grow(v0 + triangles.Edge1(triIdx));
+        box.Grow(v0 + triangles.Edge2(triIdx));
+    });
+}
+
+std::vector<aabb> BottomLevelBVH::TriangleBounds() const
+{
+    std::vector<aabb> bounds(triangles.Size());
+    for (uint i = 0; i < triangles.Size(); i++)
+    {
+        const float3 v0 = triangles.Vertex0(i);
+        bounds[i].Reset();
+        bounds[i].Grow(v0);
+        bounds[i].Grow(v0 + triangles.Edge1(i));
+        bounds[i].Grow(v0 + triangles.Edge2(i));
+    }
+    return bounds;
+}
+
+bool BottomLevelBVH::Intersect(const Ray& ray, HitRecord& hit) const
+{
+    bool isHit = false;
+    // Triangles are packed in leaf order so the leaf range indexes them directly
+    Traverse(ray, hit.t, [&](uint first, uint count)
+    {
+        rayStats.trianglesTested += count;
+        const int triIdx = triangles.Intersect(ray, first, count, hit.t, hit.uv);
+        if (triIdx < 0) { return false; }
+
+        hit.prim = triIdx;
+        isHit = true;
+        return true;
+    });
+
+    return isHit;
+}
+
+bool BottomLevelBVH::Occluded(const Ray& ray, float tMax) const
+{
+    bool isHit = false;
+    Traverse(ray, tMax, [&](uint first, uint count)
+    {
+        rayStats.trianglesTested += count;
+        float t = tMax;
+        float2 uv;
+        isHit = triangles.Intersect(ray, first, count, t, uv) >= 0;
+        return isHit;
+    }, true);
+
+    return isHit;
+}
+
+uint BottomLevelBVH::Intersect(RayPacket& packet, HitRecord* hits) const
+{
+    uint found = 0;
+    BVH::Traverse(packet, [&](uint first, uint count, uint mask)
+    {
+        // The leaf is intersected one ray at a time, with all of its triangles side by side
+        for (uint i = 0; i < RayPacket::SIZE; i++)
+        {
+            if (!(mask & (1u << i))) { continue; }
+
+            rayStats.trianglesTested += count;
+            const int triIdx = triangles.Intersect(packet.Get(i), first, count, packet.t[i], hits[i].uv);
+            if (triIdx < 0) { continue; }
+
+            hits[i].prim = triIdx;
+            found |= 1u << i;
+        }
+    });
+
+    return found;
+}
+
+uint2 BottomLevelBVH::Source(uint prim) const
+{
+    return triangles.Source(prim);
+}
+
+size_t BottomLevelBVH::TriangleCount() const
+{
+    return triangles.Size();
+}
+
+BVHMemory BottomLevelBVH::Memory() const
+{
+    BVHMemory memory = BVH::Memory();
+    memory.triangles = triangles.Memory();
+    return memory;
+}
+
+void TopLevelBVH::Build(const std::vector<aabb>& bounds, const std::vector<uint>& primitives)
+{
+    std::vector<aabb> listed(primitives.size());
+    for (size_t i = 0; i < primitives.size(); i++)
+    {
+        listed[i] = bounds[primitives[i]];
+    }
+
+    BVH::Build(listed);
+    for (uint& i : indices)
+    {
+        i = primitives[i];
+    }
+
+    leafOf.assign(bounds.size(), EMPTY_SLOT);
+    Track();
+}
+
+void TopLevelBVH::Track()
+{
+    parents.assign(tree.size(), 0);
+    costSum = 0.f;
+    deadNodes = 0;
+    for (uint i = 0; i < nodesUsed; i++)
+    {
+        if (i == 1) { continue; }
+
+        const BVHNode& node = tree[i];
+        costSum += node.Cost();
+        if (node.IsLeaf())
+        {
+            for (uint j = 0; j < node.count; j++)
+            {
+                leafOf[indices[node.leftFirst + j]] = i;
+            }
+            continue;
+        }
+
+        parents[node.leftFirst] = parents[node.leftFirst + 1] = i;
+    }
+}
+
+void TopLevelBVH::Update(const std::vector<uint>& primitives, const std::vector<aabb>& bounds)
+{
+    for (const uint primIdx : primitives)
+    {
+        if (!Contains(primIdx)) { continue; }
+
+        // Small moves are refitted, anything that leaves the box of its parent would make the tree
+        // worse than where it fits now, so it is taken out and inserted again
+        const uint leafIdx = leafOf[primIdx];
+        const BVHNode& parent = tree[leafIdx == 0 ? 0 : parents[leafIdx]];
+        const aabb& box = bounds[primIdx];
+        const bool isInside =
+            box.bmin[0] >= parent.bmin.x && box.bmin[1] >= parent.bmin.y && box.bmin[2] >= parent.bmin.z &&
+            box.bmax[0] <= parent.bmax.x && box.bmax[1] <= parent.bmax.y && box.bmax[2] <= parent.bmax.z;
+        if (isInside)
+        {
+            RefitLeaf(leafIdx, bounds);
+        }
+        else
+        {
+            Remove(primIdx, bounds);
+            Insert(primIdx, bounds);
+        }
+    }
+
+    // Quantized nodes can't be patched one slot at a time
+    if (quantize) { Collapse(); }
+}
+
+void TopLevelBVH::Insert(uint primIdx, const std::vector<aabb>& bounds)
+{
+    if (leafOf.size() <= primIdx) { leafOf.resize(primIdx + 1, EMPTY_SLOT); }
+
+    if (nodesUsed == 0)
+    {
+        std::vector<uint> primitives = { primIdx };
+        Build(bounds, primitives);
+        return;
+    }
+
+    // Go down the child whose box grows the least, the smaller one on a tie
+    const aabb& box = bounds[primIdx];
+    uint leafIdx = 0;
+    while (!tree[leafIdx].IsLeaf())
+    {
+        float bestGrowth = 1e30f, bestArea = 1e30f;
+        const uint first = tree[leafIdx].leftFirst;
+        for (uint child = first; child < first + 2; child++)
+        {
+            const BVHNode& node = tree[child];
+            aabb grown(node.bmin, node.bmax);
+            grown.Grow(box);
+            const float area = grown.Area(), growth = area - node.Area();
+            if (growth < bestGrowth || (growth == bestGrowth && area < bestArea))
+            {
+                bestGrowth = growth;
+                bestArea = area;
+                leafIdx = child;
+            }
+        }
+    }
+
+    // The leaf becomes the parent of its old primitives and the new one
+    const uint pair = AllocatePair();
+    BVHNode& leaf = tree[leafIdx];
+    BVHNode& old = tree[pair];
+    BVHNode& added = tree[pair + 1];
+    old = leaf;
+    added.leftFirst = static_cast<uint>(indices.size());
+    added.count = 1;
+    added.bmin = box.bmin3;
+    added.bmax = box.bmax3;
+    indices.push_back(primIdx);
+
+    for (uint j = 0; j < old.count; j++)
+    {
+        leafOf[indices[old.leftFirst + j]] = pair;
+    }
+    leafOf[primIdx] = pair + 1;
+    parents[pair] = parents[pair + 1] = leafIdx;
+
+    costSum += old.Cost() + added.Cost() - leaf.Cost();
+    leaf.leftFirst = pair;
+    leaf.count = 0;
+    costSum += leaf.Cost();
+
+    SetBounds(leafIdx, fminf(old.bmin, added.bmin), fmaxf(old.bmax, added.bmax));
+    RefitAncestors(leafIdx);
+    Recollapse(leafIdx);
+}
+
+void TopLevelBVH::Remove(uint primIdx, const std::vector<aabb>& bounds)
+{
+    if (!Contains(primIdx)) { return; }
+
+    const uint leafIdx = leafOf[primIdx];
+    leafOf[primIdx] = EMPTY_SLOT;
+
+    // The last primitive of the leaf takes its place
+    BVHNode& leaf = tree[leafIdx];
+    const uint last = leaf.leftFirst + leaf.count - 1;
+    uint i = leaf.leftFirst;
+    while (indices[i] != primIdx) { i++; }
+    std::swap(indices[i], indices[last]);
+
+    costSum -= leaf.Cost();
+    leaf.count--;
+    if (leaf.count > 0)
+    {
+        costSum += leaf.Cost();
+        RefitLeaf(leafIdx, bounds);
+
+        // Still the same slot, with a primitive less
+        const uint slot = wideSlot[leafIdx];
+        if (quantize) { Collapse(); }
+        else { wide[slot / 4].count[slot % 4] = leaf.count; }
+        return;
+    }
+
+    if (leafIdx == 0)
+    {
+        nodesUsed = 0;
+        wide.clear();
+        quantized.clear();
+        freeWide.clear();
+        costSum = 0.f;
+        return;
+    }
+
+    // Otherwise its sibling moves up into the parent, and the pair is left unused
+    const uint parentIdx = parents[leafIdx];
+    const uint siblingIdx = tree[parentIdx].leftFirst == leafIdx ? leafIdx + 1 : leafIdx - 1;
+    const BVHNode& sibling = tree[siblingIdx];
+    costSum -= tree[parentIdx].Cost() + sibling.Cost();
+    tree[parentIdx] = sibling;
+    costSum += sibling.Cost();
+
+    if (sibling.IsLeaf())
+    {
+        for (uint j = 0; j < sibling.count; j++)
+        {
+            leafOf[indices[sibling.leftFirst + j]] = parentIdx;
+        }
+    }
+    else
+    {
+        parents[sibling.leftFirst] = parents[sibling.leftFirst + 1] = parentIdx;
+    }
+
+    FreeWide(leafIdx);
+    FreeWide(siblingIdx);
+    wideSlot[leafIdx] = wideSlot[siblingIdx] = EMPTY_SLOT;
+    deadNodes += 2;
+
+    SetBounds(parentIdx, sibling.bmin, sibling.bmax);
+    RefitAncestors(parentIdx);
+    Recollapse(parentIdx);
+}
+
+bool TopLevelBVH::Contains(uint primIdx) const
+{
+    return primIdx < leafOf.size() && leafOf[primIdx] != EMPTY_SLOT;
+}
+
+bool TopLevelBVH::IsDegraded() const
+{
+    if (nodesUsed == 0 || buildCost <= 0.f) { return false; }
+
+    const float rootArea = tree[0].Area();
+    return deadNodes > nodesUsed / 2 || (rootArea > 0.f && costSum / rootArea > buildCost * REBUILD_RATIO);
+}
+
+void TopLevelBVH::SetBounds(uint nodeIdx, const float3& bmin, const float3& bmax)
+{
+    BVHNode& node = tree[nodeIdx];
+    costSum -= node.Cost();
+    node.bmin = bmin;
+    node.bmax = bmax;
+    costSum += node.Cost();
+
+    const uint slot = wideSlot[nodeIdx];
+    if (quantize || slot == EMPTY_SLOT) { return; }
+
+    WideNode& wideNode = wide[slot / 4];
+    for (int a = 0; a < 3; a++)
+    {
+        wideNode.bmin[a][slot % 4] = (&bmin.x)[a];
+        wideNode.bmax[a][slot % 4] = (&bmax.x)[a];
+    }
+}
 
-    // Repeat
-}
\ No newline at end of file
+void TopLevelBVH::RefitLeaf(uint leafIdx, const std::vector<aabb>& bounds)
+{
+    const BVHNode& leaf = tree[leafIdx];
+    aabb box;
+    box.Reset();
+    for (uint j = 0; j < leaf.count; j++)
+    {
+        box.Grow(bounds[indices[leaf.leftFirst + j]]);
+    }
+
+    SetBounds(leafIdx, box.bmin3, box.bmax3);
+    RefitAncestors(leafIdx);
+}
+
+void TopLevelBVH::RefitAncestors(uint nodeIdx)
+{
+    // Boxes are recomputed from the children, so where one comes out the same everything above it is right
+    while (nodeIdx != 0)
+    {
+        nodeIdx = parents[nodeIdx];
+        const BVHNode& node = tree[nodeIdx];
+        const BVHNode& left = tree[node.leftFirst];
+        const BVHNode& right = tree[node.leftFirst + 1];
+        const float3 bmin = fminf(left.bmin, right.bmin);
+        const float3 bmax = fmaxf(left.bmax, right.bmax);
+        if (bmin.x == node.bmin.x && bmin.y == node.bmin.y && bmin.z == node.bmin.z &&
+            bmax.x == node.bmax.x && bmax.y == node.bmax.y && bmax.z == node.bmax.z)
+        {
+            return;
+        }
+
+        SetBounds(nodeIdx, bmin, bmax);
+    }
+}
+
+void TopLevelBVH::Recollapse(uint nodeIdx)
+{
+    if (quantize)
+    {
+        Collapse();
+        return;
+    }
+
+    // A wide node made for this one no longer matches its children. Going up from its parent, the first
+    // node with a wide node of its own is the one it was opened into or is a slot of
+    if (nodeIdx != 0) { FreeWide(nodeIdx); }
+    uint rootIdx = nodeIdx == 0 ? 0 : parents[nodeIdx];
+    while (rootIdx != 0 && wideOf[rootIdx] == EMPTY_SLOT)
+    {
+        rootIdx = parents[rootIdx];
+    }
+
+    // The root wide node always stays at 0, and the root only has a slot of its own while it is a leaf
+    const uint wideIdx = rootIdx == 0 ? 0 : wideOf[rootIdx];
+    wideOf[rootIdx] = EMPTY_SLOT;
+    if (rootIdx == 0) { wideSlot[0] = EMPTY_SLOT; }
+    CollapseNode(rootIdx, wideIdx);
+
+    // Also drops the free ones
+    if (patchedWide > wide.size() / 2) { Collapse(); }
+}
+
+uint TopLevelBVH::AllocatePair()
+{
+    const uint first = nodesUsed;
+    nodesUsed += 2;
+    if (tree.size() < nodesUsed)
+    {
+        tree.resize(nodesUsed);
+        parents.resize(nodesUsed, 0);
+        wideOf.resize(nodesUsed, EMPTY_SLOT);
+        wideSlot.resize(nodesUsed, EMPTY_SLOT);
+    }
+    return first;
+}
+
+void BVHAccelerator::Build(const Scene& scene, const SceneChanges& changes)
+{
+    this->scene = &scene;
+    UpdateModels(changes);
+    BuildTopLevel();
+}
+
+void BVHAccelerator::Update(const Scene& scene, const SceneChanges& changes)
+{
+    this->scene = &scene;
+    UpdateModels(changes);
+
+    const auto& instances = scene.GetInstances();
+    instanceBounds.resize(instances.size());
+
+    // Removals first, their slots may have been handed out again to the added instances
+    for (const uint instance : changes.removedInstances)
+    {
+        tlas.Remove(instance, instanceBounds);
+    }
+    for (const uint instance : changes.addedInstances)
+    {
+        instanceBounds[instance] = InstanceBounds(instance);
+        tlas.Insert(instance, instanceBounds);
+    }
+
+    // Every instance of an edited model moves with its vertices
+    std::vector<uint> moved;
+    for (const uint instance : changes.movedInstances)
+    {
+        if (tlas.Contains(instance)) { moved.push_back(instance); }
+    }
+    for (const uint model : changes.editedModels)
+    {
+        const auto& of = scene.GetInstancesOf(model);
+        moved.insert(moved.end(), of.begin(), of.end());
+    }
+    for (const uint instance : moved)
+    {
+        instanceBounds[instance] = InstanceBounds(instance);
+    }
+    tlas.Update(moved, instanceBounds);
+
+    // Edits only ever patch the tree, a fresh one is built once that made it too slow
+    if (tlas.IsDegraded())
+    {
+        BuildTopLevel();
+    }
+}
+
+void BVHAccelerator::UpdateModels(const SceneChanges& changes)
+{
+    const auto& models = scene->GetModels();
+    blas.resize(models.size());
+
+    // Rebuilds of removed models can't be stopped, they are dropped once they are done
+    for (const uint model : changes.removedModels)
+    {
+        for (auto& rebuild : rebuilds)
+        {
+            if (rebuild.model == model) { rebuild.isStale = true; }
+        }
+        blas[model] = BottomLevelBVH();
+    }
+
+    for (const uint model : changes.addedModels)
+    {
+        // Caches are always written depth-first
+        if (!blas[model].ReadCache(models[model]))
+        {
+            blas[model].Build(models[model], true);
+            blas[model].WriteCache(models[model]);
+        }
+        blas[model].SetLayout(layout);
+    }
+
+    // Swap in background rebuilds that finished, they were built from older vertices so refit them
+    for (size_t i = 0; i < rebuilds.size();)
+    {
+        auto& rebuild = rebuilds[i];
+        if (rebuild.bvh.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+            i++;
+            continue;
+        }
+
+        if (!rebuild.isStale) { blas[rebuild.model].Adopt(rebuild.bvh.get(), models[rebuild.model]); }
+        rebuilds.erase(rebuilds.begin() + i);
+    }
+
+    for (const uint model : changes.editedModels)
+    {
+        auto& bvh = blas[model];
+        if (models[model].builder == BVHBuilder::LBVH)
+        {
+            // Cheap enough to build a good tree for the new vertices instead of refitting the old one
+            bvh.Build(models[model], true);
+            continue;
+        }
+
+        bvh.Refit(models[model]);
+
+        const bool isRebuilding = std::any_of(rebuilds.begin(), rebuilds.end(),
+            [model](const Rebuild& r) { return r.model == model && !r.isStale; });
+        if (!isRebuilding && bvh.IsDegraded())
+        {
+            // Not on the executor, the renderer waits for everything on it each frame
+            rebuilds.push_back({ model, std::async(std::launch::async, [bounds = bvh.TriangleBounds()]()
+            {
+                BVH rebuilt;
+                BuildTriangleTree(rebuilt, bounds, BVHBuilder::SAH, false);
+                return rebuilt;
+            }) });
+        }
+    }
+}
+
+void BVHAccelerator::BuildTopLevel()
+{
+    const auto& instances = scene->GetInstances();
+
+    // Free instance slots are left out
+    std::vector<uint> live;
+    instanceBounds.resize(instances.size());
+    for (uint i = 0; i < instances.size(); i++)
+    {
+        if (instances[i].IsRemoved()) { continue; }
+
+        instanceBounds[i] = InstanceBounds(i);
+        live.push_back(i);
+    }
+
+    tlas.SetLayout(layout);
+    tlas.Build(instanceBounds, live);
+}
+
+bool BVHAccelerator::HasPendingRebuilds() const
+{
+    return !rebuilds.empty();
+}
+
+aabb BVHAccelerator::InstanceBounds(uint instance) const
+{
+    const auto& placement = scene->GetInstances()[instance];
+
+    // From the transformed corners of its bottom level
+    const aabb local = blas[placement.model].Bounds();
+    aabb bounds;
+    bounds.Reset();
+    for (int corner = 0; corner < 8; corner++)
+    {
+        const float3 p = make_float3(
+            corner & 1 ? local.bmax[0] : local.bmin[0],
+            corner & 2 ? local.bmax[1] : local.bmin[1],
+            corner & 4 ? local.bmax[2] : local.bmin[2]);
+        bounds.Grow(placement.transform.TransformPoint(p));
+    }
+
+    return bounds;
+}
+
+bool BVHAccelerator::Intersect(const Ray& ray, HitRecord& hit) const
+{
+    if (!scene) { return false; }
+
+    const auto& instances = scene->GetInstances();
+
+    bool isHit = false;
+    tlas.Traverse(ray, hit.t, [&](uint first, uint count)
+    {
+        bool isLeafHit = false;
+        for (uint i = first; i < first + count; i++)
+        {
+            const uint instanceIdx = tlas.PrimitiveIndex(i);
+            const auto& instance = instances[instanceIdx];
+
+            // Direction is not normalized so t stays in world space
+            Ray local;
+            local.origin = instance.invTransform.TransformPoint(ray.origin);
+            local.dir = instance.invTransform.TransformVector(ray.dir);
+
+            if (blas[instance.model].Intersect(local, hit))
+            {
+                hit.instance = instanceIdx;
+                isLeafHit = true;
+            }
+        }
+        isHit |= isLeafHit;
+        return isLeafHit;
+    });
+
+    return isHit;
+}
+
+PrimaryHit BVHAccelerator::Traverse(const Ray& ray) const
+{
+    HitRecord hit;
+    Intersect(ray, hit);
+    return Resolve(ray, hit);
+}
+
+bool BVHAccelerator::Occluded(const Ray& ray, float tMax) const
+{
+    if (!scene) { return false; }
+
+    const auto& instances = scene->GetInstances();
+
+    bool isHit = false;
+    tlas.Traverse(ray, tMax, [&](uint first, uint count)
+    {
+        for (uint i = first; i < first + count && !isHit; i++)
+        {
+            const auto& instance = instances[tlas.PrimitiveIndex(i)];
+
+            Ray local;
+            local.origin = instance.invTransform.TransformPoint(ray.origin);
+            local.dir = instance.invTransform.TransformVector(ray.dir);
+            isHit = blas[instance.model].Occluded(local, tMax);
+        }
+        return isHit;
+    }, true);
+
+    return isHit;
+}
+
+void BVHAccelerator::Intersect(RayPacket& packet, HitRecord* hits) const
+{
+    if (!scene) { return; }
+
+    const auto& instances = scene->GetInstances();
+
+    tlas.Traverse(packet, [&](uint first, uint count, uint mask)
+    {
+        for (uint i = first; i < first + count; i++)
+        {
+            const uint idx = tlas.PrimitiveIndex(i);
+            const auto& instance = instances[idx];
+
+            // Rays that missed the leaf get a t that every box is behind
+            RayPacket local;
+            for (uint r = 0; r < RayPacket::SIZE; r++)
+            {
+                const Ray ray = packet.Get(r);
+                local.Set(r, Ray{ instance.invTransform.TransformPoint(ray.origin), instance.invTransform.TransformVector(ray.dir) });
+                local.t[r] = (mask & (1u << r)) ? packet.t[r] : -1e30f;
+            }
+            local.Finalize();
+
+            HitRecord localHits[RayPacket::SIZE];
+            const uint found = blas[instance.model].Intersect(local, localHits);
+            for (uint r = 0; r < RayPacket::SIZE; r++)
+            {
+                if (!(found & (1u << r))) { continue; }
+
+                packet.t[r] = local.t[r];
+                hits[r] = localHits[r];
+                hits[r].t = local.t[r];
+                hits[r].instance = idx;
+            }
+        }
+    });
+}
+
+void BVHAccelerator::Traverse(RayPacket& packet, PrimaryHit* hits) const
+{
+    HitRecord records[RayPacket::SIZE];
+    Intersect(packet, records);
+    for (uint i = 0; i < RayPacket::SIZE; i++)
+    {
+        hits[i] = Resolve(packet.Get(i), records[i]);
+    }
+}
+
+PrimaryHit BVHAccelerator::Resolve(const Ray& ray, const HitRecord& hit) const
+{
+    PrimaryHit ret;
+    if (!hit.IsHit()) { return ret; }
+
+    const auto& instance = scene->GetInstances()[hit.instance];
+    const uint2 source = blas[instance.model].Source(hit.prim);
+
+    ret.isHit = true;
+    ret.t = hit.t;
+    ret.model = &scene->GetModels()[instance.model];
+    ret.mesh = &ret.model->meshes[source.x];
+    ret.instance = hit.instance;
+    ret.face = source.y;
+    ret.uv = hit.uv;
+    ret.hit = ray.origin + ray.dir * hit.t;
+
+    // Normals go through the inverse transpose
+    ret.normal = normalize(instance.invTransform.Transposed().TransformVector(ret.mesh->Normal(source.y, hit.uv)));
+    return ret;
+}
+
+void BVHAccelerator::SetLayout(NodeLayout layout)
+{
+    this->layout = layout;
+    tlas.SetLayout(layout);
+    for (auto& b : blas)
+    {
+        b.SetLayout(layout);
+    }
+}
+
+size_t BVHAccelerator::NodeCount() const
+{
+    size_t count = tlas.NodeCount();
+    for (const auto& b : blas)
+    {
+        count += b.NodeCount();
+    }
+    return count;
+}
+
+size_t BVHAccelerator::TriangleCount() const
+{
+    size_t count = 0;
+    for (const auto& b : blas)
+    {
+        count += b.TriangleCount();
+    }
+    return count;
+}
+
+BVHMemory BVHAccelerator::Memory() const
+{
+    BVHMemory memory = tlas.Memory();
+    for (const auto& b : blas)
+    {
+        memory += b.Memory();
+    }
+    return memory;
+}
@@ -1,30 +1,647 @@
 #pragma once
 
 class Scene;
+struct SceneChanges;
 
+// Bytes taken by a tree, the wide nodes are given for both layouts whichever one is in use
+struct BVHMemory
+{
+    size_t binary = 0; // Binary nodes and primitive indices, kept for refitting and packets
+    size_t wide = 0;
+    size_t quantized = 0;
+    size_t triangles = 0;
+    bool isQuantized = false;
+
+    BVHMemory& operator+=(const BVHMemory& other);
+};
+
+// Order of the wide nodes in memory, which decides how many cache lines a ray touches on its way down
+enum class NodeLayout
+{
+    DepthFirst, // Every node before its subtrees, as Collapse makes them
+    BreadthFirst, // Level by level
+    Treelet, // Subtrees grown breadth-first until they fill a 4 KB page, stored together
+    VanEmdeBoas // The top half of the levels, then every subtree below it, recursively. Cache oblivious
+};
+
+/**
+ * Flat bounding volume hierarchy over a list of primitive bounds.
+ * Built with binned SAH, root at 0 and siblings stored next to each other.
+ * What a primitive is is up to the owner, leaves only store indices.
+ * Single rays traverse a copy collapsed into nodes of four children, packets the binary tree.
+ */
+class BVH
+{
+public:
+    static constexpr uint MAX_LEAF_SIZE = 2;
+
+    // Leaves stop splitting at maxLeafSize primitives, or earlier when splitting doesn't pay off.
+    // Parallel builds run on the global executor and wait for it, so never from a task on it
+    void Build(const std::vector<aabb>& bounds, uint maxLeafSize = MAX_LEAF_SIZE, bool parallel = false);
+    // Splits the centroids sorted along a Morton curve, much faster than Build but gives a worse tree
+    void BuildLBVH(const std::vector<aabb>& bounds, uint maxLeafSize = MAX_LEAF_SIZE, bool parallel = false);
+    // SAH build over triangles that also tries splitting space, a triangle straddling the plane then goes into
+    // both children clipped to their side. At most budget times the triangle count extra references are made
+    void BuildSBVH(const std::vector<std::array<float3, 3>>& triangles, uint maxLeafSize, float budget);
+
+    // Recomputes the node bounds bottom-up, the primitives have to be the same ones as during the build
+    void Refit(const std::vector<aabb>& bounds);
+    // Same but grow(box, primIdx) adds a primitive to a leaf box, saves gathering all bounds first
+    template <typename F>
+    void Refit(F&& grow);
+
+    // SAH cost relative to the root, grows when refitting makes the tree worse
+    float Cost() const;
+    // True when the tree got too expensive compared to when it was built
+    bool IsDegraded() const;
+
+    // Calls intersect(first, count) for every leaf the ray reaches, which returns whether it was hit.
+    // The primitives of the leaf are PrimitiveIndex(first) up to PrimitiveIndex(first + count - 1)
+    template <typename F>
+    void Traverse(const Ray& ray, const float& closest, F&& intersect, bool quitOnIntersect = false) const;
+    // Packet version, calls intersect(first, count, mask) for every leaf some of the rays reach.
+    // Bit i of mask is set when ray i hits the leaf bounds, rays are culled against their own t
+    template <typename F>
+    void Traverse(const RayPacket& packet, F&& intersect) const;
+
+    uint PrimitiveIndex(uint i) const { return indices[i]; }
+
+    // Quantized wide nodes take 80 instead of 128 bytes, for a little more work per node. Applies right away
+    void SetQuantized(bool quantize);
+    bool IsQuantized() const { return quantize; }
+    // Reorders the wide nodes right away and after every later build or refit. Primitives stay in
+    // depth-first leaf order, which already keeps the leaves of every subtree together
+    void SetLayout(NodeLayout layout);
+    NodeLayout Layout() const { return layout; }
+
+    aabb Bounds() const;
+    size_t NodeCount() const;
+    BVHMemory Memory() const;
+
+protected:
+    // Raw nodes and indices for the BVH cache, Read returns false when the stream ends early
+    void Write(std::ostream& out) const;
+    bool Read(std::istream& in);
+
+    // 32 bytes so two siblings share a cache line
+    struct ALIGN(32) BVHNode
+    {
+        union { struct { float3 bmin; uint leftFirst; }; __m128 bmin4; };
+        union { struct { float3 bmax; uint count; }; __m128 bmax4; };
+
+        bool IsLeaf() const { return count > 0; }
+        float Area() const
+        {
+            const float3 e = bmax - bmin;
+            return max(0.f, e.x * e.y + e.x * e.z + e.y * e.z);
+        }
+        // Share of the SAH cost before dividing by the root area, traversal and intersection are both counted as 1
+        float Cost() const { return Area() * (IsLeaf() ? count : 1.f); }
+    };
+
+    static constexpr uint EMPTY_SLOT = ~0u; // Child of the unused slots of a wide node
+
+    // Four children with their bounds stored per axis, so one SSE slab test covers all of them.
+    // Inner children point at another wide node and have a count of 0, leaves at their first primitive
+    struct ALIGN(64) WideNode
+    {
+        union { __m128 bmin4[3]; float bmin[3][4]; };
+        union { __m128 bmax4[3]; float bmax[3][4]; };
+        uint child[4];
+        uint count[4];
+    };
+
+    // The same node with the child bounds in 1/255ths of the node bounds, rounded outwards.
+    // Empty slots are masked by their child since there is no box that can't be hit
+    struct ALIGN(16) QuantizedNode
+    {
+        float3 origin;
+        float3 scale;
+        uint8_t qmin[3][4];
+        uint8_t qmax[3][4];
+        uint child[4];
+        uint count[4];
+    };
+
+    // Adds the nodes a traversal visited to the thread counters on the way out
+    struct NodeCounter
+    {
+        uint64_t count = 0;
+        ~NodeCounter() { rayStats.nodesVisited += count; }
+    };
+
+    // Slab test against the four children, returns a bit per child that is hit and their distances in tNear
+    static uint IntersectAABB(const __m128 origin[3], const __m128 rDir[3], const __m128 bmin[3], const __m128 bmax[3], float tMax, float tNear[4]);
+    static uint IntersectAABB(const __m128 origin[3], const __m128 rDir[3], const WideNode& node, float tMax, float tNear[4]);
+    static uint IntersectAABB(const __m128 origin[3], const __m128 rDir[3], const QuantizedNode& node, float tMax, float tNear[4]);
+    // origin + q * scale for four quantized planes
+    static __m128 Dequantize(const uint8_t q[4], float origin, float scale);
+    // Slab test for rays [group, group + 4) of a packet, returns a bit per ray that hits
+    static uint IntersectAABB(const RayPacket& packet, uint group, const BVHNode& node);
+    // Index of the first ray from first on that hits the node, or RayPacket::SIZE when none do
+    static uint FirstHit(const RayPacket& packet, uint first, const BVHNode& node);
+    // Interval arithmetic over the packet bounds, true when no ray in the packet can hit the node
+    static bool IsCulled(const RayPacket& packet, const BVHNode& node);
+
+    static constexpr int BINS = 8;
+    static constexpr uint PARALLEL_SUBTREE = 4096; // Smaller subtrees are built by the task that split them off
+    static constexpr uint PARALLEL_BINNING = 65536; // Bigger nodes are binned in chunks on several tasks
+
+    struct Bin
+    {
+        aabb bounds;
+        uint count = 0;
+    };
+    using Bins = std::array<std::array<Bin, BINS>, 3>;
+    struct BuildState;
+    struct Reference;
+    struct SpatialState;
+
+    // Bins the primitives [first, first + count) along every axis over the centroid bounds of their node
+    void BinPrimitives(uint first, uint count, const aabb& centroidBounds, const BuildState& state, Bins& bins) const;
+    // Without a subflow the whole subtree is built right away
+    void Subdivide(uint nodeIdx, const aabb& centroidBounds, BuildState& state, tf::Subflow* subflow);
+    void Split(uint nodeIdx, const aabb& centroidBounds, const Bins& bins, BuildState& state, tf::Subflow* subflow);
+    // Splits a node of sorted codes at the highest bit that differs
+    void EmitLBVH(uint nodeIdx, const std::vector<uint64_t>& codes, std::atomic<uint>& used, tf::Subflow* subflow);
+    // Picks the cheapest of an object and a spatial split, makes a leaf when neither pays off
+    void SubdivideSBVH(uint nodeIdx, std::vector<Reference> refs, SpatialState& state);
+    // Rebuilds the wide nodes from the binary tree, after every build and refit
+    void Collapse();
+    // Returns the index of the wide node made for the inner node nodeIdx, which is wideIdx when one is given
+    uint CollapseNode(uint nodeIdx, uint wideIdx = EMPTY_SLOT);
+    // Forgets the wide node made for nodeIdx, if there is one, and keeps it for the next one CollapseNode makes
+    void FreeWide(uint nodeIdx);
+    // Replaces the wide nodes with quantized ones
+    void Quantize();
+    // Puts the nodes in the order of the layout, the root stays at 0. Returns the new index of every
+    // node, or nothing when the layout keeps them where they are
+    template <typename Node>
+    std::vector<uint> Reorder(std::vector<Node>& nodes) const;
+
+    template <typename Node, typename F>
+    void TraverseWide(const std::vector<Node>& nodes, const Ray& ray, const float& closest, F&& intersect, bool quitOnIntersect) const;
+
+    // Stack for the traversals, deep enough for any sensible tree. Builds and updates don't bound the depth,
+    // so entries past the array go to the heap instead of past its end
+    template <typename Entry, uint N>
+    struct TraversalStack
+    {
+        void Push(const Entry& entry)
+        {
+            if (size < N) { entries[size++] = entry; }
+            else { overflow.push_back(entry); }
+        }
+
+        Entry Pop()
+        {
+            if (overflow.empty()) { return entries[--size]; }
+            const Entry entry = overflow.back();
+            overflow.pop_back();
+            return entry;
+        }
+
+        bool Empty() const { return size == 0; }
+
+        Entry entries[N];
+        uint size = 0;
+        std::vector<Entry> overflow; // Only filled once the array is full
+    };
+
+    std::vector<uint> indices; // Leaves index primitives through this array
+    std::vector<BVHNode> tree; // Children are always stored after their parent
+    std::vector<WideNode> wide; // Root at 0, the same tree with three of every four levels left out
+    std::vector<QuantizedNode> quantized; // Used instead of the wide nodes when quantize is set
+    bool quantize = false;
+    NodeLayout layout = NodeLayout::DepthFirst;
+    uint nodesUsed = 0;
+    uint maxLeafSize = MAX_LEAF_SIZE;
+    float buildCost = 0.f;
+
+    // Only kept when trackWide is set, for updating the wide nodes without collapsing the whole tree.
+    // Per binary node, the wide node made for it and the slot (wide node * 4 + child) it went into.
+    // Both are EMPTY_SLOT for nodes that were opened into their parent wide node
+    bool trackWide = false;
+    std::vector<uint> wideOf;
+    std::vector<uint> wideSlot;
+    std::vector<uint> freeWide; // Wide nodes no longer in the tree
+    uint patchedWide = 0; // Made since the last Collapse, wherever there was room instead of in the order of the layout
+};
+
+/**
+ * Bottom level, the triangles of a single model in object space
+ */
+class BottomLevelBVH : public BVH
+{
+public:
+    void Build(const Model& model, bool parallel = false);
+    void Refit(const Model& model);
+    // Takes over a tree built elsewhere from the bounds of this model, refits it to the current vertices
+    void Adopt(BVH&& bvh, const Model& model);
+
+    // The cache file of a model holds its tree and packed triangles, keyed by a hash of the geometry and
+    // the build settings. Reading returns false when the model has no cache path or the cache is stale
+    bool ReadCache(const Model& model);
+    void WriteCache(const Model& model) const;
+
+    // Bounds of the triangles as they were at the last Build or Refit
+    std::vector<aabb> TriangleBounds() const;
+
+    // Only updates t, uv and prim of the hit when a closer one is found, the instance is up to the caller. Leaves
+    // hold as many triangles as the intersection kernel tests at once, stored contiguously so it can load them straight away
+    bool Intersect(const Ray& ray, HitRecord& hit) const;
+    // Any hit closer than tMax, stops at the first one found
+    bool Occluded(const Ray& ray, float tMax) const;
+    // Packet version, the packet holds the t of every ray. Sets bit i of the result when ray i found a closer hit
+    uint Intersect(RayPacket& packet, HitRecord* hits) const;
+
+    // Mesh and face a triangle of a hit came from
+    uint2 Source(uint prim) const;
+
+    size_t TriangleCount() const;
+    BVHMemory Memory() const;
+
+private:
+    void Pack(const Model& model, const std::vector<uint2>& order);
+    void RefitToTriangles();
+
+    TriangleStore triangles;
+};
+
+/**
+ * Top level over primitives that come and go, the instances of a scene. Knows the parent of every node
+ * and the leaf of every primitive, so moving, inserting or removing one only touches the nodes above it
+ * and the wide node holding them. Edits leave the removed nodes behind, a rebuild cleans them up.
+ */
+class TopLevelBVH : public BVH
+{
+public:
+    TopLevelBVH() { trackWide = true; }
+
+    // Builds over the listed primitives only, bounds is indexed by primitive
+    void Build(const std::vector<aabb>& bounds, const std::vector<uint>& primitives);
+    // Moves the listed primitives to their bounds, the others have to be where they were. Primitives
+    // that moved out of the box of their parent are inserted again instead
+    void Update(const std::vector<uint>& primitives, const std::vector<aabb>& bounds);
+    // Puts the primitive next to the leaf whose box grows the least
+    void Insert(uint primIdx, const std::vector<aabb>& bounds);
+    void Remove(uint primIdx, const std::vector<aabb>& bounds);
+    bool Contains(uint primIdx) const;
+
+    // Counts the edits instead of summing every node like the base does, and also asks
+    // for a rebuild once half the nodes are left over from removals
+    bool IsDegraded() const;
+
+private:
+    // Parents, leaves and the cost sum of a freshly built tree
+    void Track();
+    // Box of a node, keeping the cost sum and the wide slot it is in up to date
+    void SetBounds(uint nodeIdx, const float3& bmin, const float3& bmax);
+    // Grows or shrinks the leaf to its primitives and the ancestors to their children, as far up as anything changes
+    void RefitLeaf(uint leafIdx, const std::vector<aabb>& bounds);
+    void RefitAncestors(uint nodeIdx);
+    // Collapses the wide node holding a node whose children changed again, the subtrees below keep theirs.
+    // Collapses the whole tree once half of the wide nodes were patched, to put them back in the order of the layout
+    void Recollapse(uint nodeIdx);
+    // Room for two more binary nodes, returns the first
+    uint AllocatePair();
+
+    std::vector<uint> parents;
+    std::vector<uint> leafOf; // EMPTY_SLOT for primitives that aren't in the tree
+    float costSum = 0.f; // Cost() before dividing by the root area
+    uint deadNodes = 0;
+};
+
+/**
+ * Top level over the model instances of a scene. Every model gets one bottom level,
+ * shared by all of its instances. Rays are moved into object space with the inverse instance transform.
+ */
 class BVHAccelerator
 {
 public:
-    void Build(const Model& model);
+    // Builds the bottom levels of the added models and the whole top level, large bottom levels are split
+    // over the executor. Models with an up to date cache file are read from it instead, the others write theirs
+    void Build(const Scene& scene, const SceneChanges& changes);
+    // Same for the models, but only inserts, removes and moves the changed instances in the top level, which
+    // costs about the same however big the scene is. Edited models have their bottom level refitted, degraded
+    // SAH ones are rebuilt on a background thread and swapped in by a later call, LBVH ones right away
+    void Update(const Scene& scene, const SceneChanges& changes);
+    bool HasPendingRebuilds() const;
 
-    //PrimaryHit Traverse(const Ray& ray);
+    // Closest hit, only updates hit when there is one nearer than hit.t. Keeps nothing of the surface, see Resolve
+    bool Intersect(const Ray& ray, HitRecord& hit) const;
+    // Closest hits of a coherent packet, hits has room for RayPacket::SIZE. The packet holds how far each
+    // ray looks, only the records of rays that found something nearer are updated
+    void Intersect(RayPacket& packet, HitRecord* hits) const;
+    // Works out the surface at a hit from Intersect, once per ray. A record without a hit gives an empty one
+    PrimaryHit Resolve(const Ray& ray, const HitRecord& hit) const;
+
+    // Intersect and Resolve in one go
+    PrimaryHit Traverse(const Ray& ray) const;
+    // Whether anything is hit before tMax, for shadow rays. tMax is in units of the ray direction
+    bool Occluded(const Ray& ray, float tMax) const;
+    void Traverse(RayPacket& packet, PrimaryHit* hits) const;
+
+    // Layout of the wide nodes of every level, new bottom levels get it too
+    void SetLayout(NodeLayout layout);
+
+    size_t NodeCount() const;
+    size_t TriangleCount() const;
+    BVHMemory Memory() const;
 
 private:
-    struct Triangle
+    const Scene* scene = nullptr;
+    NodeLayout layout = NodeLayout::DepthFirst;
+
+    // Bottom levels of the added, removed and edited models
+    void UpdateModels(const SceneChanges& changes);
+    void BuildTopLevel();
+    // World space bounds of an instance
+    aabb InstanceBounds(uint instance) const;
+
+    struct Rebuild
     {
-        const Mesh* mesh;
-        float3 triangle[3];
+        uint model;
+        std::future<BVH> bvh;
+        bool isStale = false; // The model was removed, dropped once it is done
     };
 
-    struct BVHNode
+    std::vector<BottomLevelBVH> blas; // One per model, empty for the free model slots
+    TopLevelBVH tlas;
+    std::vector<aabb> instanceBounds; // What the top level was built or last updated with
+    std::vector<Rebuild> rebuilds;
+};
+
+inline uint BVH::IntersectAABB(const __m128 origin[3], const __m128 rDir[3], const __m128 bmin[3], const __m128 bmax[3], float tMax, float tNear[4])
+{
+    const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(bmin[0], origin[0]), rDir[0]);
+    const __m128 tx2 = _mm_mul_ps(_mm_sub_ps(bmax[0], origin[0]), rDir[0]);
+    const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(bmin[1], origin[1]), rDir[1]);
+    const __m128 ty2 = _mm_mul_ps(_mm_sub_ps(bmax[1], origin[1]), rDir[1]);
+    const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(bmin[2], origin[2]), rDir[2]);
+    const __m128 tz2 = _mm_mul_ps(_mm_sub_ps(bmax[2], origin[2]), rDir[2]);
+
+    const __m128 near4 = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_min_ps(tz1, tz2));
+    const __m128 far4 = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_max_ps(tz1, tz2));
+    _mm_storeu_ps(tNear, near4);
+
+    __m128 mask = _mm_cmpge_ps(far4, near4);
+    mask = _mm_and_ps(mask, _mm_cmplt_ps(near4, _mm_set1_ps(tMax)));
+    mask = _mm_and_ps(mask, _mm_cmpgt_ps(far4, _mm_setzero_ps()));
+    return static_cast<uint>(_mm_movemask_ps(mask));
+}
+
+inline uint BVH::IntersectAABB(const __m128 origin[3], const __m128 rDir[3], const WideNode& node, float tMax, float tNear[4])
+{
+    return IntersectAABB(origin, rDir, node.bmin4, node.bmax4, tMax, tNear);
+}
+
+inline __m128 BVH::Dequantize(const uint8_t q[4], float origin, float scale)
+{
+    int bytes;
+    memcpy(&bytes, q, sizeof(bytes));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i q4 = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+    return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(_mm_cvtepi32_ps(q4), _mm_set1_ps(scale)));
+}
+
+inline uint BVH::IntersectAABB(const __m128 origin[3], const __m128 rDir[3], const QuantizedNode& node, float tMax, float tNear[4])
+{
+    const __m128 bmin[3] = {
+        Dequantize(node.qmin[0], node.origin.x, node.scale.x),
+        Dequantize(node.qmin[1], node.origin.y, node.scale.y),
+        Dequantize(node.qmin[2], node.origin.z, node.scale.z) };
+    const __m128 bmax[3] = {
+        Dequantize(node.qmax[0], node.origin.x, node.scale.x),
+        Dequantize(node.qmax[1], node.origin.y, node.scale.y),
+        Dequantize(node.qmax[2], node.origin.z, node.scale.z) };
+
+    const __m128i empty = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(node.child)), _mm_set1_epi32(static_cast<int>(EMPTY_SLOT)));
+    return IntersectAABB(origin, rDir, bmin, bmax, tMax, tNear) & ~static_cast<uint>(_mm_movemask_ps(_mm_castsi128_ps(empty)));
+}
+
+inline uint BVH::IntersectAABB(const RayPacket& packet, uint group, const BVHNode& node)
+{
+    const __m128 ox = _mm_load_ps(packet.ox + group), oy = _mm_load_ps(packet.oy + group), oz = _mm_load_ps(packet.oz + group);
+    const __m128 rdx = _mm_load_ps(packet.rdx + group), rdy = _mm_load_ps(packet.rdy + group), rdz = _mm_load_ps(packet.rdz + group);
+
+    const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmin.x), ox), rdx);
+    const __m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmax.x), ox), rdx);
+    const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmin.y), oy), rdy);
+    const __m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmax.y), oy), rdy);
+    const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmin.z), oz), rdz);
+    const __m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmax.z), oz), rdz);
+
+    const __m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_min_ps(tz1, tz2));
+    const __m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_max_ps(tz1, tz2));
+
+    __m128 mask = _mm_cmpge_ps(tFar, tNear);
+    mask = _mm_and_ps(mask, _mm_cmplt_ps(tNear, _mm_load_ps(packet.t + group)));
+    mask = _mm_and_ps(mask, _mm_cmpgt_ps(tFar, _mm_setzero_ps()));
+    return static_cast<uint>(_mm_movemask_ps(mask));
+}
+
+inline bool BVH::IsCulled(const RayPacket& packet, const BVHNode& node)
+{
+    if (!packet.isCoherent) { return false; }
+
+    // Bounds of (plane - origin) * rDir over all rays, for both planes of every axis
+    float tNear = -1e30f, tFar = 1e30f;
+    for (int a = 0; a < 3; a++)
     {
-        float3 bmin;
-        int *leftFirst;
-        float3 bmax;
-        int count;
-    };
+        const float oMin = (&packet.originMin.x)[a], oMax = (&packet.originMax.x)[a];
+        const float rdMin = (&packet.rDirMin.x)[a], rdMax = (&packet.rDirMax.x)[a];
+
+        float lo = 1e30f, hi = -1e30f;
+        for (const float plane : { (&node.bmin.x)[a], (&node.bmax.x)[a] })
+        {
+            const float d1 = plane - oMax, d2 = plane - oMin;
+            const float p[4] = { d1 * rdMin, d1 * rdMax, d2 * rdMin, d2 * rdMax };
+            lo = min(lo, min(min(p[0], p[1]), min(p[2], p[3])));
+            hi = max(hi, max(max(p[0], p[1]), max(p[2], p[3])));
+        }
+
+        // Every ray enters this slab after lo and leaves it before hi
+        tNear = max(tNear, lo);
+        tFar = min(tFar, hi);
+    }
+
+    return tNear > tFar || tFar < 0.f;
+}
+
+inline uint BVH::FirstHit(const RayPacket& packet, uint first, const BVHNode& node)
+{
+    // Try the group of the first active ray before paying for the whole packet
+    uint group = first & ~3u;
+    uint mask = IntersectAABB(packet, group, node) >> (first - group) << (first - group);
+    if (mask == 0 && IsCulled(packet, node)) { return RayPacket::SIZE; }
+
+    while (mask == 0)
+    {
+        group += 4;
+        if (group >= RayPacket::SIZE) { return RayPacket::SIZE; }
+        mask = IntersectAABB(packet, group, node);
+    }
+
+    uint lane = 0;
+    while (!(mask & (1u << lane))) { lane++; }
+    return group + lane;
+}
+
+template <typename F>
+void BVH::Refit(F&& grow)
+{
+    // Children come after their parent so going backwards visits them first
+    for (int i = static_cast<int>(nodesUsed) - 1; i >= 0; i--)
+    {
+        if (i == 1) { continue; }
+
+        BVHNode& node = tree[i];
+        if (node.IsLeaf())
+        {
+            aabb box;
+            box.Reset();
+            for (uint j = 0; j < node.count; j++)
+            {
+                grow(box, indices[node.leftFirst + j]);
+            }
+            node.bmin = box.bmin3;
+            node.bmax = box.bmax3;
+            continue;
+        }
+
+        const BVHNode& left = tree[node.leftFirst];
+        const BVHNode& right = tree[node.leftFirst + 1];
+        node.bmin = fminf(left.bmin, right.bmin);
+        node.bmax = fmaxf(left.bmax, right.bmax);
+    }
+
+    Collapse();
+}
+
+template <typename F>
+void BVH::Traverse(const Ray& ray, const float& closest, F&& intersect, bool quitOnIntersect) const
+{
+    if (quantize)
+    {
+        TraverseWide(quantized, ray, closest, intersect, quitOnIntersect);
+    }
+    else
+    {
+        TraverseWide(wide, ray, closest, intersect, quitOnIntersect);
+    }
+}
+
+template <typename Node, typename F>
+void BVH::TraverseWide(const std::vector<Node>& nodes, const Ray& ray, const float& closest, F&& intersect, bool quitOnIntersect) const
+{
+    if (nodes.empty()) { return; }
+
+    const __m128 origin[3] = { _mm_set1_ps(ray.origin.x), _mm_set1_ps(ray.origin.y), _mm_set1_ps(ray.origin.z) };
+    const __m128 rDir[3] = { _mm_set1_ps(1.f / ray.dir.x), _mm_set1_ps(1.f / ray.dir.y), _mm_set1_ps(1.f / ray.dir.z) };
+
+    NodeCounter visited;
+
+    // Leaves go on the stack like inner nodes, entries further away than the closest hit are skipped when popped
+    struct Entry { uint child; uint count; float dist; };
+    TraversalStack<Entry, 256> stack;
+    stack.Push({ 0, 0, -1e30f });
+
+    while (!stack.Empty())
+    {
+        const Entry entry = stack.Pop();
+        if (entry.dist >= closest) { continue; }
+
+        if (entry.count > 0)
+        {
+            if (intersect(entry.child, entry.count) && quitOnIntersect) { return; }
+            continue;
+        }
+
+        visited.count++;
+        const Node& node = nodes[entry.child];
+        float tNear[4];
+        const uint mask = IntersectAABB(origin, rDir, node, closest, tNear);
+
+        // Sort the children that were hit far to near, so the nearest is popped first
+        Entry hits[4];
+        uint hitCount = 0;
+        for (uint i = 0; i < 4; i++)
+        {
+            if (!(mask & (1u << i))) { continue; }
+
+            uint j = hitCount++;
+            for (; j > 0 && hits[j - 1].dist < tNear[i]; j--) { hits[j] = hits[j - 1]; }
+            hits[j] = { node.child[i], node.count[i], tNear[i] };
+        }
+        for (uint i = 0; i < hitCount; i++) { stack.Push(hits[i]); }
+    }
+}
+
+template <typename F>
+void BVH::Traverse(const RayPacket& packet, F&& intersect) const
+{
+    if (nodesUsed == 0) { return; }
+
+    // Nodes are only ever visited by the rays from the first one that hits them on,
+    // rays before it already missed an ancestor
+    struct Entry { uint node; uint first; };
+    TraversalStack<Entry, 64> stack;
+
+    NodeCounter visited;
+
+    const BVHNode* node = &tree[0];
+    uint first = FirstHit(packet, 0, *node);
+    if (first == RayPacket::SIZE) { return; }
+
+    while (true)
+    {
+        visited.count++;
+        if (node->IsLeaf())
+        {
+            uint mask = 0;
+            for (uint group = first & ~3u; group < RayPacket::SIZE; group += 4)
+            {
+                mask |= IntersectAABB(packet, group, *node) << group;
+            }
+            intersect(node->leftFirst, node->count, mask >> first << first);
+        }
+        else
+        {
+            const BVHNode* child1 = &tree[node->leftFirst];
+            const BVHNode* child2 = &tree[node->leftFirst + 1];
+            uint first1 = FirstHit(packet, first, *child1);
+            uint first2 = FirstHit(packet, first, *child2);
+
+            // Go into the child nearest along the direction of the first active ray
+            const uint rayIdx = min(first1, first2);
+            if (rayIdx != RayPacket::SIZE)
+            {
+                const float3 dir = make_float3(packet.dx[rayIdx], packet.dy[rayIdx], packet.dz[rayIdx]);
+                const float3 offset = (child2->bmin + child2->bmax) - (child1->bmin + child1->bmax);
+                if (first2 != RayPacket::SIZE && (first1 == RayPacket::SIZE || dot(offset, dir) < 0.f))
+                {
+                    std::swap(child1, child2);
+                    std::swap(first1, first2);
+                }
+
+                if (first2 != RayPacket::SIZE)
+                {
+                    stack.Push({ static_cast<uint>(child2 - tree.data()), first2 });
+                }
+                node = child1;
+                first = first1;
+                continue;
+            }
+        }
 
-    std::vector<Triangle> triangles;
-    //std::unique_ptr<BVHNode[]> tree;
-    BVHNode* tree;
-};
\ No newline at end of file
+        // Nodes on the stack are tested again, the rays may have found closer hits since they were pushed
+        do
+        {
+            if (stack.Empty()) { return; }
+            const Entry entry = stack.Pop();
+            node = &tree[entry.node];
+            first = FirstHit(packet, entry.first, *node);
+        } while (first == RayPacket::SIZE);
+    }
+}
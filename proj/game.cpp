@@ -10,38 +10,8 @@ void Game::Init()
     //obs = executor.make_observer<tf::ExecutorObserver>();
     renderer.Init(*screen, scene, screen->GetWidth() * screen->GetHeight(),512);
 
-    auto box = LoadGLTF("assets/Box/glTF/Box.gltf", mat4::Translate(2,-1,5));
-    
-    scene.Add(std::move(box));
-    
-    // --- Make a floor
-    {
-        Model fmodel; Mesh fmesh;
-        fmesh.mat.color = 0x404040;
-        
-        fmesh.faces.emplace_back();
-        fmesh.faces.back()[0] = { -100.f, -1.5f, 100.f };
-        fmesh.faces.back()[1] = { -100.f,  -1.5f, -100.f };
-        fmesh.faces.back()[2] = { 100.f,  -1.5f, -100.f };
-        fmesh.faces.emplace_back();
-        fmesh.faces.back()[0] = { 100.f, -1.5f, 100.f };
-        fmesh.faces.back()[1] = { -100.f,  -1.5f, 100.f };
-        fmesh.faces.back()[2] = { 100.f,   -1.5f, -100.f };
-
-        for (int i = 0; i < fmesh.faces.size(); i++)
-        {
-            fmesh.normals.push_back({ 0.f,1.f,0.f });
-        }
-        
-        fmodel.meshes.push_back(fmesh);
-        scene.Add(std::move(fmodel));
-    }
-    // ---
-
-    // Add a light
-    scene.Add(PointLight{ make_float3(-1,3,2),20.f });
-
-    //scene.Add(LoadGLTF("assets/Duck/glTF/Duck.gltf"));
+    BuildDefaultScene(scene);
+    scene.Commit();
     std::cout << "-----\nDone loading" << '\n';
 
     constexpr int x = 720;
@@ -69,6 +39,9 @@ void Game::Tick(float deltaTime)
 {
     dt = deltaTime; // For camera. TODO make input manager
 
+    // Pick up moved and deformed models
+    scene.Update();
+
     // clear the graphics window
     renderer.Render(camera, *screen, scene);
 
@@ -101,8 +74,49 @@ void Game::Tick(float deltaTime)
         {
             ImGui::Text("Square X: "); ImGui::SameLine(); ImGui::DragScalar("##squareX", ImGuiDataType_U32, &renderer.squareX, 0.2f, 0);
             ImGui::Text("Square Y: "); ImGui::SameLine(); ImGui::DragScalar("##squareY", ImGuiDataType_U32, &renderer.squareY, 0.2f, 0);
+            ImGui::Checkbox("Ray packets", &renderer.usePackets);
+            ImGui::Checkbox("Wavefront", &renderer.useWavefront);
+
+            const auto& stats = renderer.FrameStats();
+            const auto& rays = stats.rays;
+            const float frameTime = max(stats.frameTime, 1e-6f);
+            const float rayCount = static_cast<float>(max<uint64_t>(rays.primaryRays + rays.shadowRays, 1));
+            ImGui::Text("Frame: %.2f ms", stats.frameTime * 1000.f);
+            ImGui::Text("Primary: %.2f Mrays/s", rays.primaryRays / frameTime / 1e6f);
+            ImGui::Text("Shadow: %.2f Mrays/s", rays.shadowRays / frameTime / 1e6f);
+            ImGui::Text("Nodes/ray: %.1f", rays.nodesVisited / rayCount);
+            ImGui::Text("Triangles/ray: %.1f", rays.trianglesTested / rayCount);
+            if (renderer.useWavefront)
+            {
+                ImGui::Text("Generate %.2f ms, extend %.2f ms", stats.generateTime * 1000.f, stats.extendTime * 1000.f);
+                ImGui::Text("Shade %.2f ms, connect %.2f ms", stats.shadeTime * 1000.f, stats.connectTime * 1000.f);
+            }
+
+            for (size_t i = 0; i < stats.threadBusy.size(); i++)
+            {
+                char label[32];
+                snprintf(label, sizeof(label), "%.2f ms", stats.threadBusy[i] * 1000.f);
+                ImGui::Text("Thread %zu: ", i); ImGui::SameLine(); ImGui::ProgressBar(stats.threadBusy[i] / frameTime, ImVec2(-1.f, 0.f), label);
+            }
+
+            if (!stats.tileHistogram.empty())
+            {
+                char label[32];
+                snprintf(label, sizeof(label), "0 - %.2f ms", stats.maxTileTime * 1000.f);
+                ImGui::PlotHistogram("Tile times", stats.tileHistogram.data(), static_cast<int>(stats.tileHistogram.size()), 0, label, 0.f, FLT_MAX, ImVec2(0.f, 60.f));
+            }
 
         }
+
+        if (ImGui::CollapsingHeader("BVH"))
+        {
+            const BVHMemory memory = scene.GetBVH().Memory();
+            ImGui::Text("Nodes: %zu, triangles: %zu", scene.GetBVH().NodeCount(), scene.GetBVH().TriangleCount());
+            ImGui::Text("Binary nodes: %.2f MB", memory.binary / 1e6f);
+            ImGui::Text("Wide nodes: %.2f MB%s", memory.wide / 1e6f, memory.isQuantized ? "" : " (in use)");
+            ImGui::Text("Quantized nodes: %.2f MB%s", memory.quantized / 1e6f, memory.isQuantized ? " (in use)" : "");
+            ImGui::Text("Triangles: %.2f MB", memory.triangles / 1e6f);
+        }
         ImGui::End();
     }
 }
@@ -0,0 +1,347 @@
+#include "precomp.h"
+
+namespace
+{
+    struct LayoutName
+    {
+        NodeLayout layout;
+        const char* name;
+    };
+
+    constexpr LayoutName LAYOUTS[] = {
+        { NodeLayout::DepthFirst, "depth" },
+        { NodeLayout::BreadthFirst, "breadth" },
+        { NodeLayout::Treelet, "treelet" },
+        { NodeLayout::VanEmdeBoas, "veb" } };
+
+    // Counts a hardware event on the calling thread, only on Linux and where perf events are allowed
+    class EventCounter
+    {
+    public:
+        EventCounter(uint32_t type, uint64_t config)
+        {
+#ifdef __linux__
+            perf_event_attr attr = {};
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+        }
+        ~EventCounter()
+        {
+#ifdef __linux__
+            if (fd != -1) { close(fd); }
+#endif
+        }
+
+        bool IsAvailable() const { return fd != -1; }
+
+        void Start()
+        {
+#ifdef __linux__
+            if (fd == -1) { return; }
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+        }
+
+        uint64_t Stop()
+        {
+            uint64_t count = 0;
+#ifdef __linux__
+            if (fd == -1) { return 0; }
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != sizeof(count)) { count = 0; }
+#endif
+            return count;
+        }
+
+    private:
+        int fd = -1;
+    };
+
+    struct TriangleLayoutName
+    {
+        TriangleLayout layout;
+        const char* name;
+    };
+
+    constexpr TriangleLayoutName TRIANGLE_LAYOUTS[] = {
+        { TriangleLayout::Packed, "packed" },
+        { TriangleLayout::Indexed, "indexed" } };
+
+    // Traces every pixel center of the view single threaded, so the counters see all of the work
+    void TraceView(const Scene& scene, const HeadlessOptions& options)
+    {
+        const mat4 camera = mat4::Translate(options.camera);
+        const float3 p0 = camera.TransformPoint(make_float3(-1, 1, 1));
+        const float3 right = camera.TransformPoint(make_float3(1, 1, 1)) - p0;
+        const float3 down = camera.TransformPoint(make_float3(-1, -1, 1)) - p0;
+        const float3 eye = camera.TransformPoint(make_float3(0, 0, 0));
+
+        for (uint y = 0; y < options.height; y++)
+        {
+            for (uint x = 0; x < options.width; x++)
+            {
+                const float3 pixel = p0 + (x + 0.5f) / options.width * right + (y + 0.5f) / options.height * down;
+                Trace(Ray{ eye, normalize(pixel - eye) }, scene);
+            }
+        }
+    }
+
+    void BenchmarkLayouts(Scene& scene, const HeadlessOptions& options)
+    {
+
+#ifdef __linux__
+        EventCounter l1Misses(PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        EventCounter llcMisses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#else
+        EventCounter l1Misses(0, 0);
+        EventCounter llcMisses(0, 0);
+#endif
+        if (!l1Misses.IsAvailable() || !llcMisses.IsAvailable())
+        {
+            std::cout << "Cache miss counters are not available, only reporting times\n";
+        }
+
+        for (const auto& layout : LAYOUTS)
+        {
+            scene.SetNodeLayout(layout.layout);
+            TraceView(scene, options); // Warm up
+
+            rayStats = RayStats();
+            Timer timer;
+            l1Misses.Start();
+            llcMisses.Start();
+            TraceView(scene, options);
+            const uint64_t l1 = l1Misses.Stop();
+            const uint64_t llc = llcMisses.Stop();
+            const float time = timer.elapsed();
+
+            const float rays = static_cast<float>(options.width * options.height + rayStats.shadowRays);
+            std::cout << layout.name << ": " << rays / time / 1e6f << " Mrays/s, " << rayStats.nodesVisited / rays << " nodes/ray";
+            if (l1Misses.IsAvailable()) { std::cout << ", " << l1 / rays << " L1 misses/ray"; }
+            if (llcMisses.IsAvailable()) { std::cout << ", " << llc / rays << " LLC misses/ray"; }
+            std::cout << '\n';
+        }
+    }
+
+    // Builds the model of the scene file once in every triangle layout and traces the view with each
+    int BenchmarkTriangles(const HeadlessOptions& options)
+    {
+        if (options.scene.empty())
+        {
+            std::cout << "--bench-triangles needs a --scene file\n";
+            return 1;
+        }
+
+        Model model = LoadGLTF(options.scene.c_str(), mat4::Identity(), options.loadLog);
+        model.builder = options.builder;
+        model.quantizedNodes = options.quantized;
+        // The cache holds one layout at a time, each would overwrite the other
+        model.cachePath.clear();
+
+        // The mesh stays loaded whatever the layout, shading reads its normals
+        size_t meshBytes = 0, faceBytes = 0, faces = 0, vertices = 0;
+        for (const Mesh& mesh : model.meshes)
+        {
+            meshBytes += mesh.Memory();
+            // The same mesh as a list of faces with a normal each
+            faceBytes += mesh.FaceCount() * (sizeof(std::array<float3, 3>) + sizeof(float3));
+            faces += mesh.FaceCount();
+            vertices += mesh.IsIndexed() ? mesh.vertices.size() : mesh.FaceCount() * 3;
+        }
+        std::cout << "Mesh: " << faces << " faces, " << vertices << " vertices, " << meshBytes / 1e6f << " MB as loaded, "
+            << faceBytes / 1e6f << " MB as separate faces\n";
+
+        for (const auto& layout : TRIANGLE_LAYOUTS)
+        {
+            Scene scene;
+            Model copy = model;
+            copy.triangleLayout = layout.layout;
+            scene.Add(std::move(copy));
+            scene.Add(PointLight{ make_float3(-1,3,2),20.f });
+            scene.SetNodeLayout(options.layout);
+
+            Timer buildTimer;
+            scene.Commit();
+            const float buildTime = buildTimer.elapsed();
+
+            TraceView(scene, options); // Warm up
+            rayStats = RayStats();
+            Timer timer;
+            TraceView(scene, options);
+            const float time = timer.elapsed();
+
+            const float rays = static_cast<float>(options.width * options.height + rayStats.shadowRays);
+            const size_t storeBytes = scene.GetBVH().Memory().triangles;
+            std::cout << layout.name << ": mesh " << meshBytes / 1e6f << " MB + triangles " << storeBytes / 1e6f << " MB = "
+                << (meshBytes + storeBytes) / 1e6f << " MB, build " << buildTime * 1000.f << " ms, " << rays / time / 1e6f
+                << " Mrays/s, " << rayStats.trianglesTested / rays << " triangles/ray\n";
+        }
+        return 0;
+    }
+}
+
+bool ParseHeadlessOptions(int argc, char** argv, HeadlessOptions& options, bool isHeadless)
+{
+    // The windowed build has arguments of its own, only warn about them when this one is going to run
+    std::vector<std::string> ignored;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--headless") { isHeadless = true; }
+        else if (arg == "--quantized") { options.quantized = true; }
+        else if (arg == "--bench-layouts") { options.benchLayouts = true; }
+        else if (arg == "--bench-triangles") { options.benchTriangles = true; }
+        else if (arg == "--wavefront") { options.wavefront = true; }
+        else if (arg == "--layout" && hasValue)
+        {
+            const std::string layout = argv[++i];
+            const auto it = std::find_if(std::begin(LAYOUTS), std::end(LAYOUTS), [&](const LayoutName& l) { return layout == l.name; });
+            if (it != std::end(LAYOUTS)) { options.layout = it->layout; }
+            else { std::cout << "Unknown layout " << layout << '\n'; }
+        }
+        else if (arg == "--triangles" && hasValue)
+        {
+            const std::string layout = argv[++i];
+            const auto it = std::find_if(std::begin(TRIANGLE_LAYOUTS), std::end(TRIANGLE_LAYOUTS), [&](const TriangleLayoutName& l) { return layout == l.name; });
+            if (it != std::end(TRIANGLE_LAYOUTS)) { options.triangles = it->layout; }
+            else { std::cout << "Unknown triangle layout " << layout << '\n'; }
+        }
+        else if (arg == "--width" && hasValue) { options.width = max(1, atoi(argv[++i])); }
+        else if (arg == "--height" && hasValue) { options.height = max(1, atoi(argv[++i])); }
+        else if (arg == "--spp" && hasValue) { options.spp = max(1, atoi(argv[++i])); }
+        else if (arg == "--scene" && hasValue) { options.scene = argv[++i]; }
+        else if (arg == "--out" && hasValue) { options.out = argv[++i]; }
+        else if (arg == "--builder" && hasValue)
+        {
+            const std::string builder = argv[++i];
+            if (builder == "sah") { options.builder = BVHBuilder::SAH; }
+            else if (builder == "sbvh") { options.builder = BVHBuilder::SBVH; }
+            else if (builder == "lbvh") { options.builder = BVHBuilder::LBVH; }
+            else { std::cout << "Unknown builder " << builder << '\n'; }
+        }
+        else if (arg == "--load-log" && hasValue)
+        {
+            const std::string log = argv[++i];
+            if (log == "silent") { options.loadLog = LoadLog::Silent; }
+            else if (log == "summary") { options.loadLog = LoadLog::Summary; }
+            else if (log == "detail") { options.loadLog = LoadLog::Detail; }
+            else { std::cout << "Unknown load log " << log << '\n'; }
+        }
+        else if (arg == "--camera" && i + 3 < argc)
+        {
+            options.camera.x = static_cast<float>(atof(argv[++i]));
+            options.camera.y = static_cast<float>(atof(argv[++i]));
+            options.camera.z = static_cast<float>(atof(argv[++i]));
+        }
+        else
+        {
+            ignored.push_back(arg);
+        }
+    }
+
+    if (isHeadless)
+    {
+        for (const auto& arg : ignored)
+        {
+            std::cout << "Ignoring argument " << arg << '\n';
+        }
+    }
+    return isHeadless;
+}
+
+int RenderHeadless(const HeadlessOptions& options)
+{
+    if (options.benchTriangles) { return BenchmarkTriangles(options); }
+
+    Scene scene;
+    if (options.scene.empty())
+    {
+        BuildDefaultScene(scene);
+    }
+    else
+    {
+        Model model = LoadGLTF(options.scene.c_str(), mat4::Identity(), options.loadLog);
+        model.builder = options.builder;
+        model.quantizedNodes = options.quantized;
+        model.triangleLayout = options.triangles;
+        scene.Add(std::move(model));
+        scene.Add(PointLight{ make_float3(-1,3,2),20.f });
+    }
+
+    Timer buildTimer;
+    scene.SetNodeLayout(options.layout);
+    scene.Commit();
+    std::cout << "Build: " << buildTimer.elapsed() * 1000.f << " ms, " << scene.GetBVH().TriangleCount() << " triangles\n";
+
+    const BVHMemory memory = scene.GetBVH().Memory();
+    std::cout << "Memory: binary nodes " << memory.binary / 1e6f << " MB, wide nodes " << memory.wide / 1e6f
+        << " MB, quantized nodes " << memory.quantized / 1e6f << " MB, triangles " << memory.triangles / 1e6f << " MB ("
+        << (memory.isQuantized ? "quantized" : "wide") << " nodes in use)\n";
+
+    if (options.benchLayouts)
+    {
+        BenchmarkLayouts(scene, options);
+        return 0;
+    }
+
+    Surface screen(options.width, options.height);
+    Renderer renderer;
+    renderer.Init(screen, scene, options.width * options.height, options.spp);
+    renderer.useWavefront = options.wavefront;
+
+    // One Render call adds one sample per pixel
+    const mat4 camera = mat4::Translate(options.camera);
+    float renderTime = 0.f;
+    float stageTimes[4] = {};
+    RayStats rays;
+    for (uint i = 0; i < options.spp; i++)
+    {
+        renderer.Render(camera, screen, scene);
+
+        const auto& stats = renderer.FrameStats();
+        renderTime += stats.frameTime;
+        rays.Add(stats.rays);
+        stageTimes[0] += stats.generateTime;
+        stageTimes[1] += stats.extendTime;
+        stageTimes[2] += stats.shadeTime;
+        stageTimes[3] += stats.connectTime;
+    }
+
+    const float rayCount = static_cast<float>(max<uint64_t>(rays.primaryRays + rays.shadowRays, 1));
+    std::cout << "Render: " << renderTime * 1000.f << " ms for " << options.spp << " samples\n";
+    std::cout << "Primary: " << rays.primaryRays / renderTime / 1e6f << " Mrays/s, shadow: " << rays.shadowRays / renderTime / 1e6f << " Mrays/s\n";
+    std::cout << "Nodes/ray: " << rays.nodesVisited / rayCount << ", triangles/ray: " << rays.trianglesTested / rayCount << '\n';
+    if (options.wavefront)
+    {
+        std::cout << "Stages: generate " << stageTimes[0] * 1000.f << " ms, extend " << stageTimes[1] * 1000.f << " ms, shade "
+            << stageTimes[2] * 1000.f << " ms, connect " << stageTimes[3] * 1000.f << " ms\n";
+    }
+
+    // Pixels are 0x00BBGGRR, so the first three bytes of every pixel are already in order
+    std::vector<unsigned char> rgb(options.width * options.height * 3);
+    const Pixel* buffer = screen.GetBuffer();
+    for (uint i = 0; i < options.width * options.height; i++)
+    {
+        rgb[i * 3 + 0] = buffer[i] & 0xff;
+        rgb[i * 3 + 1] = (buffer[i] >> 8) & 0xff;
+        rgb[i * 3 + 2] = (buffer[i] >> 16) & 0xff;
+    }
+
+    if (!stbi_write_png(options.out.c_str(), options.width, options.height, 3, rgb.data(), options.width * 3))
+    {
+        std::cout << "Failed to write " << options.out << '\n';
+        return 1;
+    }
+
+    std::cout << "Wrote " << options.out << '\n';
+    return 0;
+}
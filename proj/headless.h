@@ -0,0 +1,34 @@
+#pragma once
+
+/**
+ * Renders to an image file without a window, GL context or ImGui, for machines without a display.
+ * Started with: --headless [--width W] [--height H] [--spp N] [--scene file.gltf] [--builder sah|sbvh|lbvh]
+ *     [--quantized] [--triangles packed|indexed] [--layout depth|breadth|treelet|veb] [--load-log silent|summary|detail]
+ *     [--wavefront] [--camera X Y Z] [--out file.png]
+ * With --bench-layouts it traces the view once with every node layout and reports cache misses instead.
+ * With --bench-triangles it builds the scene file with every triangle layout and reports their memory and speed.
+ */
+struct HeadlessOptions
+{
+    uint width = SCRWIDTH;
+    uint height = SCRHEIGHT;
+    uint spp = 16;
+    std::string scene; // Empty renders the default scene
+    BVHBuilder builder = BVHBuilder::SAH; // Of the scene file
+    bool quantized = false; // Of the scene file
+    TriangleLayout triangles = TriangleLayout::Packed; // Of the scene file
+    LoadLog loadLog = LoadLog::Summary;
+    NodeLayout layout = NodeLayout::DepthFirst;
+    bool benchLayouts = false;
+    bool benchTriangles = false;
+    bool wavefront = false; // Render with the wavefront stages instead of tiles
+    float3 camera = make_float3(0.f);
+    std::string out = "frame.png";
+};
+
+// Returns false when the arguments don't ask for a headless render. isHeadless skips the check for --headless,
+// for the headless build that has no window to fall back to
+bool ParseHeadlessOptions(int argc, char** argv, HeadlessOptions& options, bool isHeadless = false);
+
+// Returns the exit code of the process
+int RenderHeadless(const HeadlessOptions& options);
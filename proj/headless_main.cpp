@@ -0,0 +1,10 @@
+#include "precomp.h"
+
+// Entry point of the headless build, which leaves out the window, GL, OpenCL and ImGui parts of the template.
+// There's no window to fall back to, so --headless is implied. The windowed build goes through main in template.cpp
+int main(int argc, char** argv)
+{
+    HeadlessOptions options;
+    ParseHeadlessOptions(argc, argv, options, true);
+    return RenderHeadless(options);
+}
@@ -9,18 +9,75 @@ struct Material
     Pixel color;
 };
 
+// Either a list of faces, or vertices that faces share through an index buffer
 struct Mesh
 {
     std::vector<std::array<float3,3>> faces; // x y z
-    std::vector<float3> normals; // Saved for only one vertex in the face
+    std::vector<float3> vertices; // Indexed only
+    std::vector<uint> indices; // Indexed only, three per face
+    std::vector<float3> normals; // One per vertex when indexed, otherwise saved for only one vertex in the face
 
     Material mat;
+
+    bool IsIndexed() const { return !indices.empty(); }
+    size_t FaceCount() const { return IsIndexed() ? indices.size() / 3 : faces.size(); }
+    std::array<float3, 3> Face(size_t i) const
+    {
+        if (!IsIndexed()) { return faces[i]; }
+        return { vertices[indices[i * 3]], vertices[indices[i * 3 + 1]], vertices[indices[i * 3 + 2]] };
+    }
+    // Normal of the first vertex of the face
+    float3 FaceNormal(size_t i) const { return normals[IsIndexed() ? indices[i * 3] : i]; }
+    // Normal at barycentrics uv of the face, smooth between the vertex normals when indexed. Not normalized
+    float3 Normal(size_t i, const float2& uv) const
+    {
+        if (!IsIndexed()) { return normals[i]; }
+        return (1.f - uv.x - uv.y) * normals[indices[i * 3]] + uv.x * normals[indices[i * 3 + 1]] + uv.y * normals[indices[i * 3 + 2]];
+    }
+
+    // Bytes of the geometry
+    size_t Memory() const
+    {
+        return faces.size() * sizeof(faces[0]) + vertices.size() * sizeof(float3) + indices.size() * sizeof(uint) + normals.size() * sizeof(float3);
+    }
+};
+
+// How the bottom level of a model is built
+enum class BVHBuilder
+{
+    SAH, // Good tree, for static models
+    SBVH, // SAH that also splits big triangles between nodes, slower to build and larger but faster to trace
+    LBVH // Sorted Morton codes, fast enough to rebuild every frame for deforming models
+};
+
+// How the bottom level of a model stores its triangles for intersection
+enum class TriangleLayout
+{
+    Packed, // Vertex 0 and both edges of every triangle precomputed, the fastest to intersect
+    Indexed // Reads the vertices of the meshes through their indices, no copy of the geometry but the edges are made while tracing
 };
 
 struct Model
 {
-    mat4 transform = mat4::Identity();
-    std::vector<Mesh> meshes;
+    mat4 transform = mat4::Identity(); // Transform of the instance created when adding it to a scene
+    std::vector<Mesh> meshes; // Object space
+    BVHBuilder builder = BVHBuilder::SAH;
+    float splitBudget = 0.5f; // SBVH only, extra triangle references it may make as a part of the triangle count
+    bool quantizedNodes = false; // Smaller bottom level nodes for big models, a little slower to traverse
+    TriangleLayout triangleLayout = TriangleLayout::Packed;
+    std::string cachePath; // Where the built bottom level is cached, LoadGLTF puts it next to the file
+};
+
+// Placement of a model in the scene, instances of the same model share its geometry
+struct ModelInstance
+{
+    static constexpr uint REMOVED = ~0u; // Model of a free slot, until a new instance takes it
+
+    uint model; // Index into the scene models
+    mat4 transform;
+    mat4 invTransform;
+
+    bool IsRemoved() const { return model == REMOVED; }
 };
 
 struct PointLight
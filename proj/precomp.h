@@ -7,6 +7,9 @@
 // - solve issues with the order of header files once (here)
 // do not include headers in header files (ever).
 
+// Define HEADLESS to build only the renderer and the headless entry point, without the window, OpenGL, OpenCL,
+// ImGui or FreeImage. The Linux build in CMakeLists.txt does
+
 // Default screen resolution
 #define SCRWIDTH 512
 #define SCRHEIGHT 512
@@ -14,15 +17,22 @@
 //384
 
 // C++ headers
+#include <atomic>
 #include <chrono>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <numeric>
 #include <vector>
 #include <string>
 #include <thread>
+#include <type_traits>
 #include <math.h>
 
 // Headers for Dear ImGui
+#ifndef HEADLESS
 #if defined(_MSC_VER) && !defined(_CRT_SECURE_NO_WARNINGS)
 #define _CRT_SECURE_NO_WARNINGS
 #endif
@@ -50,11 +60,17 @@
 #include <stdint.h>     // intptr_t
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
+#endif
 
 // Header for AVX, and every technology before it.
 // If your CPU does not support this (unlikely), include the appropriate header instead.
 // See: https://stackoverflow.com/a/11228864/2844473
 #include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>     // __cpuid
+#else
+#include <cpuid.h>      // __get_cpuid
+#endif
 
 // clang-format off
 
@@ -74,8 +90,17 @@ using namespace std;
 #include <io.h>
 #else
 #include <unistd.h>
+#include <sys/stat.h>
 #endif
 
+// Hardware counters for the benchmarks
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#ifndef HEADLESS
 // OpenCL headers
 #include "cl/cl.h"
 #include <cl/cl_gl_ext.h>
@@ -87,6 +112,7 @@ using namespace std;
 
 // Tool includes
 #include <FreeImage.h>			// image loading. http://freeimage.sourceforge.net
+#endif
 #include <zlib.h>				// compression. https://www.zlib.net
 #include <taskflow.hpp>			// multithreading. https://github.com/cpp-taskflow
 #include <half.hpp>				// half floats. http://half.sourceforge.net
@@ -106,14 +132,21 @@ using namespace Tmpl8;
 // Raytracer stuff
 #include "utils.h"
 #include "model.h"
+#include "ray.h"
+#include "triangles.h"
 #include "bvh.h"
 #include "scene.h"
 #include "tiny_gltf.h"
+#include "stb_image.h"
+#include "stb_image_write.h"
 #include "asset_loader.h"
 
 // Game
 #include "raytracer.h"
+#ifndef HEADLESS
 #include "game.h"				// game class
+#endif
+#include "headless.h"
 
 // clang-format on
 
@@ -0,0 +1,119 @@
+#pragma once
+
+/**
+ * Ray and hit records shared by the acceleration structures and the renderer
+ */
+
+struct Ray
+{
+    float3 origin;
+    float3 dir;
+};
+
+// All that traversal keeps of the closest hit so far. The surface there is worked out once the ray is done
+struct HitRecord
+{
+    static constexpr uint NONE = ~0u;
+
+    float t = 1e30f;
+    float2 uv; // Barycentrics on the triangle
+    uint instance = NONE;
+    uint prim; // Triangle in the bottom level of the instance's model
+
+    bool IsHit() const { return instance != NONE; }
+};
+
+// The surface at a hit, for shading
+struct PrimaryHit
+{
+    bool isHit = false;
+    float t = -1.f;
+
+    const Model* model;
+    const Mesh* mesh;
+    uint instance;
+    uint face;
+    float2 uv; // Barycentrics, the hit is at (1 - u - v) * vertex0 + u * vertex1 + v * vertex2
+    float3 hit;
+    float3 normal; // Interpolated between the vertex normals of indexed meshes
+
+    Pixel color;
+};
+
+/**
+ * Counters of the thread tracing, the acceleration structures add the nodes and triangles they visit.
+ * The renderer collects and resets them after every frame
+ */
+struct RayStats
+{
+    uint64_t primaryRays = 0;
+    uint64_t shadowRays = 0;
+    uint64_t nodesVisited = 0; // A packet visiting a node counts once
+    uint64_t trianglesTested = 0;
+
+    void Add(const RayStats& other)
+    {
+        primaryRays += other.primaryRays;
+        shadowRays += other.shadowRays;
+        nodesVisited += other.nodesVisited;
+        trianglesTested += other.trianglesTested;
+    }
+};
+
+extern thread_local RayStats rayStats;
+
+/**
+ * Rays of a square block of pixels, one array per component so four rays can be tested at once.
+ * When all directions share their signs the bounds over the packet are used to reject whole nodes at once.
+ */
+struct RayPacket
+{
+    static constexpr uint WIDTH = 4; // Pixels along each side of the block
+    static constexpr uint SIZE = WIDTH * WIDTH;
+
+    ALIGN(16) float ox[SIZE]; ALIGN(16) float oy[SIZE]; ALIGN(16) float oz[SIZE];
+    ALIGN(16) float dx[SIZE]; ALIGN(16) float dy[SIZE]; ALIGN(16) float dz[SIZE];
+    ALIGN(16) float rdx[SIZE]; ALIGN(16) float rdy[SIZE]; ALIGN(16) float rdz[SIZE];
+    ALIGN(16) float t[SIZE]; // Closest hit so far
+
+    float3 originMin, originMax;
+    float3 rDirMin, rDirMax;
+    bool isCoherent = false;
+
+    void Set(uint i, const Ray& ray)
+    {
+        ox[i] = ray.origin.x; oy[i] = ray.origin.y; oz[i] = ray.origin.z;
+        dx[i] = ray.dir.x; dy[i] = ray.dir.y; dz[i] = ray.dir.z;
+        t[i] = 1e30f;
+    }
+
+    Ray Get(uint i) const
+    {
+        return Ray{ make_float3(ox[i], oy[i], oz[i]), make_float3(dx[i], dy[i], dz[i]) };
+    }
+
+    // Computes the reciprocal directions and the packet bounds, call once all rays are set
+    void Finalize()
+    {
+        originMin = rDirMin = make_float3(1e30f);
+        originMax = rDirMax = make_float3(-1e30f);
+        uint positive = 7, negative = 7; // Axes along which every ray goes forward or backward
+        for (uint i = 0; i < SIZE; i++)
+        {
+            rdx[i] = 1.f / dx[i]; rdy[i] = 1.f / dy[i]; rdz[i] = 1.f / dz[i];
+
+            const float3 o = make_float3(ox[i], oy[i], oz[i]);
+            const float3 rd = make_float3(rdx[i], rdy[i], rdz[i]);
+            originMin = fminf(originMin, o);
+            originMax = fmaxf(originMax, o);
+            rDirMin = fminf(rDirMin, rd);
+            rDirMax = fmaxf(rDirMax, rd);
+
+            positive &= (dx[i] > 0.f) | (dy[i] > 0.f) << 1 | (dz[i] > 0.f) << 2;
+            negative &= (dx[i] < 0.f) | (dy[i] < 0.f) << 1 | (dz[i] < 0.f) << 2;
+        }
+
+        // A component of zero or mixed signs make the reciprocal bounds infinite
+        isCoherent = (positive | negative) == 7;
+    }
+};
@@ -1,101 +1,75 @@
 #include "precomp.h"
 
-float TriangleIntersect(const Ray& ray, const float3& vertex0, const float3& vertex1, const float3& vertex2)
+namespace
 {
-    //https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
-    const float EPSILON = 0.0000001;
-    float3 edge1, edge2, h, s, q;
-    float a, f, u, v;
-    edge1 = vertex1 - vertex0;
-    edge2 = vertex2 - vertex0;
-    h = cross(ray.dir, edge2);
-    a = dot(edge1, h);
-    if (a > -EPSILON && a < EPSILON)
-        return -1.f;    // This ray is parallel to this triangle.
-    f = 1.0 / a;
-    s = ray.origin - vertex0;
-    u = f * dot(s, h);
-    if (u < 0.0 || u > 1.0)
-        return -1.f;
-    q = cross(s, edge1);
-    v = f * dot(ray.dir, q);
-    if (v < 0.0 || u + v > 1.0)
-        return -1.f;
-    // At this stage we can compute t to find out where the intersection point is on the line.
-    float t = f * dot(edge2, q);
-    if (t > EPSILON) // ray intersection
-    {
-        return t;
-    }
-    else // This means that there is a line intersection but not a ray intersection.
-        return -1.f;
-}
+    constexpr size_t WAVEFRONT_CHUNK = 4096; // Fewest items of a wavefront pass given to one task
 
-struct TraceHit
-{
-    float t = -1.f;
-    float3 normal;
-};
-
-TraceHit GetIntersection(const Ray& ray, const Mesh& mesh, bool quitOnIntersect = false)
-{
-    TraceHit ret;
-
-    // Iterate over each face
-    for (size_t i = 0; i < mesh.faces.size(); i++)
+    // Jittered ray through pixel i, j of a screen of bw by bh
+    Ray GenerateRay(Xorshf96& rand, float3 e, float3 topLeft, float3 right, float3 down, uint i, uint j, uint bw, uint bh)
     {
-        const auto& face = mesh.faces[i];
+        float u = (float)i / bw;
+        float v = (float)j / bh;
+        float px = 1.f / (float)bw;
+        float py = 1.f / (float)bh;
+        float3 r = u * right + px * rand.random(1.f);
+        float3 d = v * down + py * rand.random(1.f);
+        float3 P = topLeft + r + d;
+        float3 D = normalize(P - e);
+
+        Ray ray;
+        ray.origin = e;
+        ray.dir = D;
+        return ray;
+    }
 
-        auto t = TriangleIntersect(
-            ray, face[0], face[1], face[2]);
+    // Light the point light adds to the surface when nothing blocks it, and the shadow ray with how far
+    // it has to look to find out. Surfaces facing away from the light get nothing
+    float3 DirectLight(const PrimaryHit& hit, const PointLight& light, Ray& shadow, float& tMax)
+    {
+        const float3 toLight = light.pos - hit.hit;
+        const float dist = length(toLight);
+        float3 dir = toLight / dist;
+        shadow = Ray{ hit.hit + dir*0.0001f, dir };
 
-        // Check hit
-        if (t > 0.f && (t < ret.t || ret.t == -1.f))
-        {
-            ret.t = t;
-            ret.normal = mesh.normals[i];
+        // Only what is between the hit and the light blocks it
+        tMax = dist - 0.0002f;
 
-            if (quitOnIntersect)
-            {
-                return ret;
-            }
-        }
+        // This is very incorrect but temp
+        float l = 1.f; // Light intensity
+        return ToColor(hit.mesh->mat.color) * l * max(0.f, dot(hit.normal, shadow.dir));
     }
 
-    return ret;
-}
-
-// I think the template optimizes the bool call since it generates a function definition
-PrimaryHit Trace(const Ray& ray, const Scene& scene, bool quitOnIntersect = false)
-{
-    PrimaryHit ret;
+    // Runs pass(first, last) over [0, n) in chunks spread over the executor, and adds up the ray counters of the chunks.
+    // The tasks are made again in flow, which is kept from pass to pass
+    template <typename F>
+    void ParallelPass(tf::Taskflow& flow, size_t n, F&& pass, RayStats& rays)
+    {
+        const size_t chunks = max<size_t>(1, min<size_t>(executor.num_workers() * 4, (n + WAVEFRONT_CHUNK - 1) / WAVEFRONT_CHUNK));
+        std::vector<RayStats> chunkRays(chunks);
 
-    // Get closest intersection
-    for (const auto& model : scene.GetModels())
-    {        
-        for (const auto& mesh : model.meshes)
+        flow.clear();
+        for (size_t c = 0; c < chunks; c++)
         {
-            auto hit = GetIntersection(ray, mesh, quitOnIntersect);
-
-            if (hit.t > 0.f && (ret.t == -1.f || hit.t < ret.t))
+            flow.emplace([&, c]()
             {
-                ret.isHit = true;
-
-                ret.t = hit.t;
-                ret.model = &model;
-                ret.mesh = &mesh;
-
-                ret.hit = ray.origin + ray.dir * hit.t;
-                ret.normal = hit.normal;
+                rayStats = RayStats();
+                pass(n * c / chunks, n * (c + 1) / chunks);
+                chunkRays[c] = rayStats;
+            });
+        }
+        executor.run(flow).wait();
 
-                if (quitOnIntersect)
-                {
-                    ret.color = ToPixel(ray.dir * 0xff);
-                    return ret;
-                }
-            }
+        for (const auto& chunk : chunkRays)
+        {
+            rays.Add(chunk);
         }
     }
+}
+
+// Works out the surface at the closest hit and colors it, traced on its own or as part of a packet
+PrimaryHit Shade(const Ray& ray, const HitRecord& record, const Scene& scene)
+{
+    PrimaryHit ret = scene.GetBVH().Resolve(ray, record);
 
     // No hit at all
     if (!ret.isHit)
@@ -105,29 +79,32 @@ PrimaryHit Trace(const Ray& ray, const Scene& scene, bool quitOnIntersect = fals
     }
 
     // Do whitted shading
-    float3 finalColor;
+    float3 finalColor = make_float3(0.f);
     for(const auto& light: scene.GetLights())
     {
-        float3 dir = normalize(light.pos - ret.hit);
-        Ray shadow{ ret.hit + dir*0.0001f, dir };
+        Ray shadow;
+        float tMax;
+        const float3 color = DirectLight(ret, light, shadow, tMax);
 
-        // NOTE: ray does not have a length so what can happen is it intersects past the light.
-        auto sh = Trace(shadow, scene, true);
-        if(!sh.isHit)
+        rayStats.shadowRays++;
+        if(!scene.GetBVH().Occluded(shadow, tMax))
         {
-            // This is very incorrect but temp
-            float l = 1.f; // Light intensity
-
-            finalColor += ToColor(ret.mesh->mat.color) * l * max(0.f,dot(ret.normal,shadow.dir));
+            finalColor += color;
         }
     }
 
     
     ret.color = ToPixel(finalColor);
-    
     return ret;
 }
 
+PrimaryHit Trace(const Ray& ray, const Scene& scene)
+{
+    HitRecord record;
+    scene.GetBVH().Intersect(ray, record);
+    return Shade(ray, record, scene);
+}
+
 /**
  * buffer: screen buffer
  * e: eye pos
@@ -137,40 +114,72 @@ PrimaryHit Trace(const Ray& ray, const Scene& scene, bool quitOnIntersect = fals
  * h: height of area
  * bw: buffer width
  * hw: buffer height
+ * usePackets: trace blocks of RayPacket::WIDTH squared pixels together
  */
 void RenderArea(
     Xorshf96& rand, Pixel* buffer, float3* accumelator, unsigned spp, float3 e, float3 topLeft, float3 right, float3 down,
-    uint x, uint y, uint w, uint h, uint bw, uint bh, const Scene& scene)
+    uint x, uint y, uint w, uint h, uint bw, uint bh, const Scene& scene, bool usePackets)
 {
-    // Iterate over area
-    for (uint j = y; j < y + h; j++)
+    auto generate = [&](uint i, uint j)
     {
-        float v = (float)j / bh;
-        for (uint i = x; i < x + w; i++)
+        return GenerateRay(rand, e, topLeft, right, down, i, j, bw, bh);
+    };
+
+    auto store = [&](uint i, uint j, const PrimaryHit& hit)
+    {
+        accumelator[j * bw + i] += ToColor(hit.color);
+        float3 p = accumelator[j * bw + i];
+        float scale = 1.0f / spp;
+        p *= scale;
+
+        buffer[j * bw + i] = ToPixel(p);
+    };
+
+    // Iterate over area in blocks the size of a packet, blocks sticking out of the area are traced one ray at a time
+    constexpr uint N = RayPacket::WIDTH;
+    for (uint by = y; by < y + h; by += N)
+    {
+        for (uint bx = x; bx < x + w; bx += N)
         {
-            // Generate ray
-            float u = (float)i / bw;
-            float px = 1.f / (float)bw;
-            float py = 1.f / (float)bh;
-            float3 r = u * right + px * rand.random(1.f);
-            float3 d = v * down + py * rand.random(1.f);
-            float3 P = topLeft + r + d;
-            float3 D = normalize(P - e);
-
-            Ray ray;
-            ray.origin = e;
-            ray.dir = D;
-
-            auto hit = Trace(ray, scene);
-            
-            accumelator[j * bw + i] += ToColor(hit.color);
-            float3 p = accumelator[j * bw + i];
-            float scale = 1.0f / spp;
-            p *= scale;
-            
-            buffer[j * bw + i] = ToPixel(p);
+            if (usePackets && bx + N <= x + w && by + N <= y + h)
+            {
+                RayPacket packet;
+                for (uint k = 0; k < RayPacket::SIZE; k++)
+                {
+                    packet.Set(k, generate(bx + k % N, by + k / N));
+                }
+                packet.Finalize();
+
+                // Diverging packets can't use the packet bounds, they are faster as single rays
+                if (packet.isCoherent)
+                {
+                    HitRecord records[RayPacket::SIZE];
+                    scene.GetBVH().Intersect(packet, records);
+                    for (uint k = 0; k < RayPacket::SIZE; k++)
+                    {
+                        store(bx + k % N, by + k / N, Shade(packet.Get(k), records[k], scene));
+                    }
+                }
+                else
+                {
+                    for (uint k = 0; k < RayPacket::SIZE; k++)
+                    {
+                        store(bx + k % N, by + k / N, Trace(packet.Get(k), scene));
+                    }
+                }
+                continue;
+            }
+
+            for (uint j = by; j < min(by + N, y + h); j++)
+            {
+                for (uint i = bx; i < min(bx + N, x + w); i++)
+                {
+                    store(i, j, Trace(generate(i, j), scene));
+                }
+            }
         }
     }
+    rayStats.primaryRays += w * h;
     //std::cout << rand.random(1.f) << '\n';
 }
 
@@ -183,23 +192,84 @@ void Renderer::Init(Surface& screen, const Scene& scene, unsigned pixelCount, un
     accumelator = std::make_unique<float3[]>(pixelCount);
     memset(accumelator.get(), 0, pixelCount * sizeof(float3));
 
-    for (uint j = 0; j < screen.GetHeight() ; j += squareY)
+    // One task per thread, each pulls tiles from a shared counter until the frame is done.
+    // Cheap tiles don't hold up a thread that could be taking the next one
+    const uint workers = static_cast<uint>(executor.num_workers());
+    workerRays.resize(workers);
+    workerBusy.resize(workers);
+    tileFlow.clear();
+    for (uint i = 0; i < workers; i++)
     {
-        for (uint i = 0; i < screen.GetWidth(); i += squareX)
+        tileFlow.emplace([&, i]() { RenderTiles(screen, scene, i); });
+    }
+}
+
+void Renderer::Partition(Surface& screen)
+{
+    const uint width = screen.GetWidth();
+    const uint height = screen.GetHeight();
+    partitionSize = make_uint2(squareX, squareY);
+
+    tiles.clear();
+    for (uint j = 0; j < height; j += squareY)
+    {
+        for (uint i = 0; i < width; i += squareX)
         {
-            AddTask( [&, i, j, r = Xorshf96(i + j * screen.GetWidth())]() mutable
-            {
-                
-                //(i + j * screen.GetWidth());
-                RenderArea(r,
-                    screen.GetBuffer(), 
-                    accumelator.get(), spp, E, p0, right, down, i, j, squareX, squareY, 
-                    screen.GetWidth(), screen.GetHeight(), scene);
-            });
+            tiles.push_back({ i, j, min(squareX, width - i), min(squareY, height - j), Xorshf96(i + j * width) });
         }
     }
+
+    order.resize(tiles.size());
+    for (uint i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
 }
 
+void Renderer::RenderTiles(Surface& screen, const Scene& scene, uint worker)
+{
+    rayStats = RayStats();
+    float busy = 0.f;
+    for (uint idx = nextTile++; idx < order.size(); idx = nextTile++)
+    {
+        Tile& tile = tiles[order[idx]];
+
+        Timer timer;
+        RenderArea(tile.rand,
+            screen.GetBuffer(),
+            accumelator.get(), spp, E, p0, right, down, tile.x, tile.y, tile.w, tile.h,
+            screen.GetWidth(), screen.GetHeight(), scene, usePackets);
+        tile.cost = timer.elapsed();
+        busy += tile.cost;
+    }
+
+    workerRays[worker] = rayStats;
+    workerBusy[worker] = busy;
+}
+
+void Renderer::CollectStats(float frameTime)
+{
+    stats.frameTime = frameTime;
+    stats.rays = RayStats();
+    for (const auto& rays : workerRays)
+    {
+        stats.rays.Add(rays);
+    }
+    stats.threadBusy = workerBusy;
+
+    constexpr uint BUCKETS = 16;
+    stats.maxTileTime = 0.f;
+    for (const auto& tile : tiles)
+    {
+        stats.maxTileTime = max(stats.maxTileTime, tile.cost);
+    }
+    stats.tileHistogram.assign(BUCKETS, 0.f);
+    for (const auto& tile : tiles)
+    {
+        const uint bucket = stats.maxTileTime > 0.f ? static_cast<uint>(tile.cost / stats.maxTileTime * (BUCKETS - 1)) : 0;
+        stats.tileHistogram[bucket]++;
+    }
+}
 
 void Renderer::Render(const mat4& t, Surface& screen, const Scene& scene)
 {
@@ -215,14 +285,183 @@ void Renderer::Render(const mat4& t, Surface& screen, const Scene& scene)
     right = p1 - p0;
     down = p2 - p0;
 
+    if (useWavefront)
+    {
+        RenderWavefront(screen, scene);
+        return;
+    }
+
     // If we want no MT :(
     //RenderArea(
     //    screen.GetBuffer(), accumelator.get(), spp, E, p0, right, down, 0, 0, width, height, width, height, scene);
     //return;
 
-    // Calculate the tasks to render
-    RunTasks();
-    WaitForAll();
+    squareX = max(squareX, 1u);
+    squareY = max(squareY, 1u);
+    if (partitionSize.x != squareX || partitionSize.y != squareY)
+    {
+        Partition(screen);
+    }
+
+    // Start with the most expensive tiles so no thread picks up a slow one right at the end
+    std::stable_sort(order.begin(), order.end(), [this](uint a, uint b) { return tiles[a].cost > tiles[b].cost; });
+    nextTile = 0;
+
+    Timer timer;
+    executor.run(tileFlow).wait();
+    CollectStats(timer.elapsed());
+}
+
+void Renderer::RenderWavefront(Surface& screen, const Scene& scene)
+{
+    const uint width = screen.GetWidth();
+    const uint height = screen.GetHeight();
+    const uint count = width * height;
+    const uint lights = static_cast<uint>(scene.GetLights().size());
+    const BVHAccelerator& bvh = scene.GetBVH();
+
+    paths.Resize(count);
+    pathHits.resize(count);
+    radiance.resize(count);
+    shadows.Resize(count * lights);
+    shadowLight.resize(count * lights);
+
+    RayStats rays;
+    Timer frameTimer;
+    Timer stageTimer;
+
+    // Generate: camera rays go in blocks of RayPacket::WIDTH squared pixels, a row of blocks after the other,
+    // so the extend stage finds whole packets next to each other. Every row of blocks has its own random numbers
+    constexpr uint N = RayPacket::WIDTH;
+    ParallelPass(passFlow, (height + N - 1) / N, [&](size_t first, size_t last)
+    {
+        for (uint by = static_cast<uint>(first) * N; by < last * N; by += N)
+        {
+            Xorshf96 rand(by + spp * height);
+            const uint rows = min(N, height - by);
+            for (uint bx = 0; bx < width; bx += N)
+            {
+                const uint columns = min(N, width - bx);
+                uint idx = by * width + bx * rows;
+                for (uint j = by; j < by + rows; j++)
+                {
+                    for (uint i = bx; i < bx + columns; i++)
+                    {
+                        paths.Set(idx++, GenerateRay(rand, E, p0, right, down, i, j, width, height), 1e30f, j * width + i);
+                    }
+                }
+            }
+        }
+    }, rays);
+    stats.generateTime = stageTimer.elapsed();
+
+    // Extend: closest hits only, the surfaces are left to the shade stage
+    stageTimer.reset();
+    constexpr uint SIZE = RayPacket::SIZE;
+    ParallelPass(passFlow, (count + SIZE - 1) / SIZE, [&](size_t first, size_t last)
+    {
+        for (uint group = static_cast<uint>(first) * SIZE; group < last * SIZE; group += SIZE)
+        {
+            const uint groupSize = min(SIZE, count - group);
+            rayStats.primaryRays += groupSize;
+            for (uint k = 0; k < groupSize; k++)
+            {
+                pathHits[group + k] = HitRecord();
+            }
+
+            RayPacket packet;
+            if (usePackets && groupSize == SIZE)
+            {
+                for (uint k = 0; k < SIZE; k++)
+                {
+                    packet.Set(k, paths.Get(group + k));
+                }
+                packet.Finalize();
+            }
+
+            // Diverging packets can't use the packet bounds, they are faster as single rays
+            if (packet.isCoherent)
+            {
+                bvh.Intersect(packet, &pathHits[group]);
+                continue;
+            }
+            for (uint k = 0; k < groupSize; k++)
+            {
+                bvh.Intersect(paths.Get(group + k), pathHits[group + k]);
+            }
+        }
+    }, rays);
+    stats.extendTime = stageTimer.elapsed();
+
+    // Shade: the surface of every hit, and a shadow ray in the slot of every light that could reach it
+    stageTimer.reset();
+    ParallelPass(passFlow, count, [&](size_t first, size_t last)
+    {
+        for (size_t i = first; i < last; i++)
+        {
+            const uint pixel = paths.pixel[i];
+            const Ray ray = paths.Get(i);
+            const PrimaryHit hit = bvh.Resolve(ray, pathHits[i]);
+            radiance[pixel] = hit.isHit ? make_float3(0.f) : ray.dir;
+            for (uint l = 0; l < lights; l++)
+            {
+                const uint slot = pixel * lights + l;
+                shadowLight[slot] = make_float3(0.f);
+                shadows.tMax[slot] = 0.f;
+                if (!hit.isHit) { continue; }
+
+                Ray shadow;
+                float tMax;
+                const float3 color = DirectLight(hit, scene.GetLights()[l], shadow, tMax);
+                if (color.x > 0.f || color.y > 0.f || color.z > 0.f)
+                {
+                    shadows.Set(slot, shadow, tMax, pixel);
+                    shadowLight[slot] = color;
+                }
+            }
+        }
+    }, rays);
+    stats.shadeTime = stageTimer.elapsed();
+
+    // Connect: blocked shadow rays take their light away, then every pixel adds up what is left in its slots
+    stageTimer.reset();
+    ParallelPass(passFlow, shadows.Size(), [&](size_t first, size_t last)
+    {
+        for (size_t i = first; i < last; i++)
+        {
+            if (shadows.tMax[i] <= 0.f) { continue; }
+
+            rayStats.shadowRays++;
+            if (bvh.Occluded(shadows.Get(i), shadows.tMax[i]))
+            {
+                shadowLight[i] = make_float3(0.f);
+            }
+        }
+    }, rays);
+
+    ParallelPass(passFlow, count, [&](size_t first, size_t last)
+    {
+        const float scale = 1.0f / spp;
+        for (size_t pixel = first; pixel < last; pixel++)
+        {
+            float3 color = radiance[pixel];
+            for (uint l = 0; l < lights; l++)
+            {
+                color += shadowLight[pixel * lights + l];
+            }
+
+            // Rounded to a pixel first like the tiles do, so both add up the same samples
+            accumelator[pixel] += ToColor(ToPixel(color));
+            screen.GetBuffer()[pixel] = ToPixel(accumelator[pixel] * scale);
+        }
+    }, rays);
+    stats.connectTime = stageTimer.elapsed();
+
+    stats.frameTime = frameTimer.elapsed();
+    stats.rays = rays;
+    stats.threadBusy.clear();
+    stats.tileHistogram.clear();
+    stats.maxTileTime = 0.f;
 }
 
 void Renderer::OnMove()
@@ -240,3 +479,8 @@ unsigned Renderer::MaxSampleCount() const
 {
     return maxSampleCount;
 }
+
+const Renderer::Stats& Renderer::FrameStats() const
+{
+    return stats;
+}
@@ -3,31 +3,67 @@
  * Contains the render systems that is responsible for rendering a scene
  */
 
-// ------------
-// Classes/Structs
-// ------------
-struct Ray
-{
-    float3 origin;
-    float3 dir;
-};
+// Closest hit of the ray, then its surface with its shading and shadow rays
+PrimaryHit Trace(const Ray& ray, const Scene& scene);
 
-struct PrimaryHit
+/**
+ * Rays waiting for a stage of the wavefront renderer, one array per component. Every ray knows its pixel,
+ * so a queue can be reordered between stages without losing track of where the results go
+ */
+struct RayQueue
 {
-    bool isHit = false;
-    float t = -1.f;
+    std::vector<float> ox, oy, oz;
+    std::vector<float> dx, dy, dz;
+    std::vector<float> tMax; // How far the ray looks, zero for a slot without a ray
+    std::vector<uint> pixel;
 
-    const Model* model;
-    const Mesh* mesh;
-    float3 hit;
-    float3 normal;
-    
-    Pixel color;
+    void Resize(size_t size)
+    {
+        for (auto* component : { &ox, &oy, &oz, &dx, &dy, &dz, &tMax })
+        {
+            component->resize(size);
+        }
+        pixel.resize(size);
+    }
+
+    size_t Size() const { return pixel.size(); }
+
+    void Set(size_t i, const Ray& ray, float t, uint p)
+    {
+        ox[i] = ray.origin.x; oy[i] = ray.origin.y; oz[i] = ray.origin.z;
+        dx[i] = ray.dir.x; dy[i] = ray.dir.y; dz[i] = ray.dir.z;
+        tMax[i] = t;
+        pixel[i] = p;
+    }
+
+    Ray Get(size_t i) const
+    {
+        return Ray{ make_float3(ox[i], oy[i], oz[i]), make_float3(dx[i], dy[i], dz[i]) };
+    }
 };
 
+// ------------
+// Classes/Structs
+// ------------
 class Renderer
 {
 public:
+    // Collected over the last rendered frame
+    struct Stats
+    {
+        float frameTime = 0.f;
+        RayStats rays;
+        std::vector<float> threadBusy; // Seconds every worker spent on tiles
+        std::vector<float> tileHistogram; // Number of tiles per bucket, evenly spaced up to maxTileTime
+        float maxTileTime = 0.f;
+
+        // Wavefront only, seconds every stage took
+        float generateTime = 0.f;
+        float extendTime = 0.f;
+        float shadeTime = 0.f;
+        float connectTime = 0.f;
+    };
+
     void Init(Surface& screen, const Scene& scene, unsigned pixelCount, unsigned maxSampleCount = 128);
 
     void Render(const mat4& t, Surface& screen, const Scene& scene);
@@ -37,12 +73,41 @@ public:
 
     unsigned SampleCount() const;
     unsigned MaxSampleCount() const;
+    const Stats& FrameStats() const;
     
+    // Tile size, the frame is split up again when it changes
     unsigned squareX;
     unsigned squareY;
+    bool usePackets = true; // Trace coherent 4x4 blocks of primary rays together
+    bool useWavefront = false; // Trace the whole frame one stage at a time over queues of rays, instead of tile by tile
 
 
 private:
+    struct Tile
+    {
+        uint x, y, w, h;
+        Xorshf96 rand;
+        float cost = 0.f; // Seconds the tile took last frame
+    };
+
+    // Splits the screen into tiles of the current size
+    void Partition(Surface& screen);
+    // Takes tiles until there are none left, every worker thread runs one of these per frame
+    void RenderTiles(Surface& screen, const Scene& scene, uint worker);
+    void CollectStats(float frameTime);
+    // Generate, extend, shade and connect, each a parallel pass over the rays of the whole frame
+    void RenderWavefront(Surface& screen, const Scene& scene);
+
+    std::vector<Tile> tiles;
+    std::vector<uint> order; // Tiles sorted from most to least expensive last frame
+    std::atomic<uint> nextTile{ 0 };
+    uint2 partitionSize = make_uint2(0, 0);
+
+    // Written by every worker at the end of its tiles, merged into stats after the frame
+    std::vector<RayStats> workerRays;
+    std::vector<float> workerBusy;
+    Stats stats;
+
     unsigned spp = 0;
     unsigned maxSampleCount;
     unsigned pixelCount;
@@ -55,4 +120,16 @@ private:
     float3 down;
 
     std::unique_ptr<float3[]> accumelator;
+
+    // Kept here rather than in the global taskflow, which is destroyed after the node pool of the main thread
+    // that it would hand its tasks back to
+    tf::Taskflow tileFlow; // A RenderTiles task per worker
+    tf::Taskflow passFlow; // Made again for every wavefront pass
+
+    // Wavefront queues, kept from frame to frame so they are only allocated again when the screen grows
+    RayQueue paths; // Camera rays
+    std::vector<HitRecord> pathHits; // Of every camera ray
+    std::vector<float3> radiance; // Per pixel, what needs no shadow ray
+    RayQueue shadows; // A slot per pixel and light
+    std::vector<float3> shadowLight; // What every shadow ray brings in when nothing blocks it
 };
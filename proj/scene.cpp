@@ -1,8 +1,116 @@
 #include "precomp.h"
 
-void Scene::Add(Model&& model)
+namespace
 {
-    m_models.push_back(model);
+    // Otherwise growing the model list would copy all of their geometry
+    static_assert(std::is_nothrow_move_constructible_v<Model>, "Models have to move without copying their meshes");
+
+    // Returns whether the value was there
+    template <typename T>
+    bool Erase(std::vector<T>& values, const T& value)
+    {
+        const auto it = std::find(values.begin(), values.end(), value);
+        if (it == values.end()) { return false; }
+
+        values.erase(it);
+        return true;
+    }
+}
+
+bool SceneChanges::IsEmpty() const
+{
+    return addedModels.empty() && removedModels.empty() && editedModels.empty() &&
+        addedInstances.empty() && removedInstances.empty() && movedInstances.empty();
+}
+
+void SceneChanges::Clear()
+{
+    addedModels.clear();
+    removedModels.clear();
+    editedModels.clear();
+    addedInstances.clear();
+    removedInstances.clear();
+    movedInstances.clear();
+}
+
+InstanceHandle Scene::Add(Model&& model)
+{
+    uint index;
+    if (m_freeModels.empty())
+    {
+        index = static_cast<uint>(m_models.size());
+        m_models.push_back(std::move(model));
+        m_instancesOf.emplace_back();
+    }
+    else
+    {
+        index = m_freeModels.back();
+        m_freeModels.pop_back();
+        m_models[index] = std::move(model);
+    }
+
+    m_changes.addedModels.push_back(index);
+    return NewInstance(index, m_models[index].transform);
+}
+
+InstanceHandle Scene::AddInstance(InstanceHandle of, const mat4& transform)
+{
+    if (!IsLive(of)) { return NO_INSTANCE; }
+    return NewInstance(m_instances[of].model, transform);
+}
+
+InstanceHandle Scene::NewInstance(uint model, const mat4& transform)
+{
+    const ModelInstance instance = { model, transform, transform.Inverted() };
+
+    InstanceHandle handle;
+    if (m_freeInstances.empty())
+    {
+        handle = static_cast<InstanceHandle>(m_instances.size());
+        m_instances.push_back(instance);
+    }
+    else
+    {
+        handle = m_freeInstances.back();
+        m_freeInstances.pop_back();
+        m_instances[handle] = instance;
+    }
+
+    m_instancesOf[model].push_back(handle);
+    m_changes.addedInstances.push_back(handle);
+    return handle;
+}
+
+void Scene::Remove(InstanceHandle instance)
+{
+    // The model of a free slot is REMOVED, which is no index into the models
+    if (!IsLive(instance)) { return; }
+
+    const uint model = m_instances[instance].model;
+    Erase(m_instancesOf[model], instance);
+    m_instances[instance].model = ModelInstance::REMOVED;
+    m_freeInstances.push_back(instance);
+
+    // One that was added since the last update never made it into the acceleration structure
+    if (!Erase(m_changes.addedInstances, instance))
+    {
+        m_changes.removedInstances.push_back(instance);
+    }
+
+    if (!m_instancesOf[model].empty()) { return; }
+
+    m_models[model] = Model();
+    m_freeModels.push_back(model);
+    Erase(m_changes.editedModels, model);
+    if (!Erase(m_changes.addedModels, model))
+    {
+        m_changes.removedModels.push_back(model);
+    }
+}
+
+bool Scene::IsLive(InstanceHandle instance) const
+{
+    return instance < m_instances.size() && !m_instances[instance].IsRemoved();
 }
 
 void Scene::Add(PointLight&& light)
@@ -13,6 +121,49 @@ void Scene::Add(PointLight&& light)
 void Scene::Clear()
 {
     m_models.clear();
+    m_instancesOf.clear();
+    m_instances.clear();
+    m_freeModels.clear();
+    m_freeInstances.clear();
+    m_lights.clear();
+    m_changes.Clear();
+    m_bvh = BVHAccelerator();
+}
+
+void Scene::Commit()
+{
+    m_bvh.Build(*this, m_changes);
+    m_changes.Clear();
+}
+
+void Scene::Update()
+{
+    if (m_changes.IsEmpty() && !m_bvh.HasPendingRebuilds()) { return; }
+
+    m_bvh.Update(*this, m_changes);
+    m_changes.Clear();
+}
+
+void Scene::SetNodeLayout(NodeLayout layout)
+{
+    m_bvh.SetLayout(layout);
+}
+
+void Scene::SetTransform(InstanceHandle instance, const mat4& transform)
+{
+    m_instances[instance].transform = transform;
+    m_instances[instance].invTransform = transform.Inverted();
+    m_changes.movedInstances.push_back(instance);
+}
+
+Model& Scene::EditModel(InstanceHandle instance)
+{
+    const uint model = m_instances[instance].model;
+    if (std::find(m_changes.editedModels.begin(), m_changes.editedModels.end(), model) == m_changes.editedModels.end())
+    {
+        m_changes.editedModels.push_back(model);
+    }
+    return m_models[model];
 }
 
 const std::vector<Model>& Scene::GetModels() const
@@ -20,7 +171,58 @@ const std::vector<Model>& Scene::GetModels() const
     return m_models;
 }
 
+const std::vector<ModelInstance>& Scene::GetInstances() const
+{
+    return m_instances;
+}
+
+const std::vector<InstanceHandle>& Scene::GetInstancesOf(uint model) const
+{
+    return m_instancesOf[model];
+}
+
 const std::vector<PointLight>& Scene::GetLights() const
 {
     return m_lights;
 }
+
+const BVHAccelerator& Scene::GetBVH() const
+{
+    return m_bvh;
+}
+
+void BuildDefaultScene(Scene& scene)
+{
+    auto box = LoadGLTF("assets/Box/glTF/Box.gltf", mat4::Translate(2,-1,5));
+    
+    scene.Add(std::move(box));
+    
+    // --- Make a floor
+    {
+        Model fmodel; Mesh fmesh;
+        fmesh.mat.color = 0x404040;
+        
+        fmesh.faces.emplace_back();
+        fmesh.faces.back()[0] = { -100.f, -1.5f, 100.f };
+        fmesh.faces.back()[1] = { -100.f,  -1.5f, -100.f };
+        fmesh.faces.back()[2] = { 100.f,  -1.5f, -100.f };
+        fmesh.faces.emplace_back();
+        fmesh.faces.back()[0] = { 100.f, -1.5f, 100.f };
+        fmesh.faces.back()[1] = { -100.f,  -1.5f, 100.f };
+        fmesh.faces.back()[2] = { 100.f,   -1.5f, -100.f };
+
+        for (int i = 0; i < fmesh.faces.size(); i++)
+        {
+            fmesh.normals.push_back({ 0.f,1.f,0.f });
+        }
+        
+        fmodel.meshes.push_back(fmesh);
+        scene.Add(std::move(fmodel));
+    }
+    // ---
+
+    // Add a light
+    scene.Add(PointLight{ make_float3(-1,3,2),20.f });
+
+    //scene.Add(LoadGLTF("assets/Duck/glTF/Duck.gltf"));
+}
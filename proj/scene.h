@@ -1,20 +1,80 @@
 #pragma once
 
+// Index of an instance in GetInstances, stays valid until the instance is removed
+using InstanceHandle = uint;
+// Handed out instead of an instance when there is nothing to make one of
+constexpr InstanceHandle NO_INSTANCE = ~0u;
+
+// Everything that changed since the acceleration structure was last built or updated, as model
+// and instance indices. A removed slot can show up again as added when a new one took it
+struct SceneChanges
+{
+    std::vector<uint> addedModels;
+    std::vector<uint> removedModels;
+    std::vector<uint> editedModels;
+    std::vector<InstanceHandle> addedInstances;
+    std::vector<InstanceHandle> removedInstances;
+    std::vector<InstanceHandle> movedInstances; // May hold removed or repeated ones
+
+    bool IsEmpty() const;
+    void Clear();
+};
+
 /**
  * Responsible for ownership of meshes
  */
 class Scene
 {
 public:
-    void Add(Model&& model);
+    // Adds the model with one instance at its own transform, returns the handle of that instance.
+    // Takes over its geometry, more instances share it through AddInstance instead of adding copies
+    InstanceHandle Add(Model&& model);
+    // Another instance of the model of an existing one, they share the model and its bottom level BVH.
+    // NO_INSTANCE when that one was removed
+    InstanceHandle AddInstance(InstanceHandle of, const mat4& transform);
+    // The model goes with its last instance. The slots of both are reused by later adds.
+    // Removing one that is already gone does nothing
+    void Remove(InstanceHandle instance);
     void Add(PointLight&& light);
 
     void Clear();
 
+    // Builds the acceleration structure, call after adding models
+    void Commit();
+    // Brings the acceleration structure up to date with the changes since the last Commit or Update, in
+    // time that depends on how much changed rather than on the size of the scene. Much cheaper than Commit
+    void Update();
+
+    // Memory order of the BVH nodes, only changes how fast rays are traced
+    void SetNodeLayout(NodeLayout layout);
+
+    void SetTransform(InstanceHandle instance, const mat4& transform);
+    // For changing the vertices of the model of the instance, which all of its instances share.
+    // The number of faces has to stay the same. Picked up by the next Update
+    Model& EditModel(InstanceHandle instance);
+
+    // Models and instances in free slots are empty and removed
     const std::vector<Model>& GetModels() const;
+    const std::vector<ModelInstance>& GetInstances() const;
+    const std::vector<InstanceHandle>& GetInstancesOf(uint model) const;
     const std::vector<PointLight>& GetLights() const;
+    const BVHAccelerator& GetBVH() const;
 
 private:
+    InstanceHandle NewInstance(uint model, const mat4& transform);
+    // Whether the handle is in range and its slot isn't free
+    bool IsLive(InstanceHandle instance) const;
+
     std::vector<Model> m_models;
+    std::vector<std::vector<InstanceHandle>> m_instancesOf; // Per model
+    std::vector<ModelInstance> m_instances;
+    std::vector<uint> m_freeModels;
+    std::vector<InstanceHandle> m_freeInstances;
     std::vector<PointLight> m_lights;
-};
\ No newline at end of file
+
+    BVHAccelerator m_bvh;
+    SceneChanges m_changes;
+};
+
+// Fills the scene with the models and lights shown on startup and by the headless mode, doesn't commit it
+void BuildDefaultScene(Scene& scene);
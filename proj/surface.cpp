@@ -40,6 +40,21 @@ Surface::Surface( const char *a_File ) :
 
 void Surface::LoadImage( const char *a_File )
 {
+#ifdef HEADLESS
+	// no FreeImage in the headless build, use stb_image that comes with the glTF loader
+	int channels;
+	unsigned char* pixels = stbi_load( a_File, &m_Width, &m_Height, &channels, 4 );
+	if (!pixels) FatalError( "Could not load image: %s", a_File );
+	m_Pitch = m_Width;
+	m_Buffer = (Pixel*)MALLOC64( m_Width * m_Height * sizeof( Pixel ) );
+	m_Flags = OWNER;
+	for (int i = 0; i < m_Width * m_Height; i++)
+	{
+		const unsigned char* p = pixels + i * 4;
+		m_Buffer[i] = (p[3] << 24) + (p[0] << 16) + (p[1] << 8) + p[2];
+	}
+	stbi_image_free( pixels );
+#else
 	FREE_IMAGE_FORMAT fif = FIF_UNKNOWN;
 	fif = FreeImage_GetFileType( a_File, 0 );
 	if (fif == FIF_UNKNOWN) fif = FreeImage_GetFIFFromFilename( a_File );
@@ -56,6 +71,7 @@ void Surface::LoadImage( const char *a_File )
 		memcpy( m_Buffer + y * m_Pitch, line, m_Width * sizeof( Pixel ) );
 	}
 	FreeImage_Unload( dib );
+#endif
 }
 
 Surface::~Surface()
@@ -3,6 +3,8 @@
 
 #include "precomp.h"
 
+// The window, GL and OpenCL parts are left out of the headless build, it has its own entry point in headless_main.cpp
+#ifndef HEADLESS
 #pragma comment( linker, "/subsystem:windows /ENTRY:mainCRTStartup" )
 
 // Enable usage of dedicated GPUs in notebooks
@@ -62,8 +64,11 @@ void ErrorCallback( int error, const char*description )
 }
 
 // Application entry point
-void main()
+void main( int argc, char** argv )
 {
+	// farm machines render straight to a file, without a window
+	HeadlessOptions headless;
+	if (ParseHeadlessOptions( argc, argv, headless )) exit( RenderHeadless( headless ) );
 	// open a window
 	if (!glfwInit()) FatalError( "glfwInit failed." );
 	glfwSetErrorCallback( ErrorCallback );
@@ -154,6 +159,7 @@ void main()
 	glfwDestroyWindow( window );
 	glfwTerminate();
 }
+#endif
 
 // Basic TaskFlow interface - see https://github.com/cpp-taskflow/cpp-taskflow for additional options
 tf::Executor executor;
@@ -161,6 +167,7 @@ tf::Taskflow taskflow;
 void RunTasks() { executor.run( taskflow ); }
 void WaitForAll() { executor.wait_for_all(); }
 
+#ifndef HEADLESS
 // Jobmanager implementation                                                          LH2'20|
 DWORD JobThreadProc( LPVOID lpParameter )
 {
@@ -559,6 +566,7 @@ void Shader::SetUInt( const char* name, const uint v )
 	glUniform1ui( glGetUniformLocation( ID, name ), v );
 	CheckGL();
 }
+#endif
 
 // RNG - Marsaglia's xor32
 static uint seed = 0x12345678;
@@ -670,6 +678,17 @@ bool FileExists( const char *f )
 	return s.good();
 }
 
+uint64_t StreamBytesLeft( istream& s )
+{
+	// 0 for streams that can't seek, they are left failed
+	const streampos pos = s.tellg();
+	if (pos < 0) return 0;
+	s.seekg( 0, ios::end );
+	const streampos end = s.tellg();
+	s.seekg( pos );
+	return end < pos ? 0 : (uint64_t)(end - pos);
+}
+
 bool RemoveFile( const char *f )
 {
 	if (!FileExists( f )) return false;
@@ -719,6 +738,7 @@ void FatalError( const char *fmt, ... )
 	while (1) exit( 0 );
 }
 
+#ifndef HEADLESS
 // static members of Kernel class
 bool Kernel::clinitialized = false, Kernel::candoInterop = true;
 char* Kernel::log = 0;
@@ -3904,5 +3924,6 @@ int gladLoadGLLoader( GLADloadproc load )
 	load_GL_EXT_memory_object_win32( load );
 	return GLVersion.major != 0 || GLVersion.minor != 0;
 }
+#endif
 
 // EOF
\ No newline at end of file
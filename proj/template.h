@@ -3,7 +3,9 @@
 
 #pragma once
 
+#ifndef HEADLESS
 extern GLFWwindow* window;
+#endif
 
 // Basic types
 typedef unsigned char uchar;
@@ -23,7 +25,8 @@ typedef int BOOL;				// for freeimage.h
 #define FREE64( x ) _aligned_free( x )
 #else
 #define ALIGN( x ) __attribute__( ( aligned( x ) ) )
-#define MALLOC64( x ) ( ( x ) == 0 ? 0 : aligned_alloc( 64, ( x ) ) )
+// aligned_alloc only takes sizes that are a multiple of the alignment, surfaces of any width and height aren't
+#define MALLOC64( x ) ( ( x ) == 0 ? 0 : aligned_alloc( 64, ( ( x ) + 63 ) / 64 * 64 ) )
 #define FREE64( x ) free( x )
 #endif
 #if defined(__GNUC__) && (__GNUC__ >= 4)
@@ -53,6 +56,7 @@ struct ALIGN( 4 ) uchar4 { uchar x, y, z, w; };
 #define FATALERROR_IN( prefix, errstr, fmt, ... ) FatalError( prefix " returned error '%s' at %s:%d" fmt "\n", errstr, __FILE__, __LINE__, ##__VA_ARGS__ );
 #define FATALERROR_IN_CALL( stmt, error_parser, fmt, ... ) do { auto ret = ( stmt ); if ( ret ) FATALERROR_IN( #stmt, error_parser( ret ), fmt, ##__VA_ARGS__ ) } while ( 0 )
 
+#ifndef HEADLESS
 // OpenGL texture wrapper
 class GLTexture
 {
@@ -175,6 +179,7 @@ private:
 public:
 	static bool candoInterop;
 };
+#endif
 
 // Timer
 struct Timer
@@ -201,6 +206,7 @@ template <typename C> void AddTask( C&& callable ) { taskflow.emplace( callable
 void RunTasks();
 void WaitForAll();
 
+#ifndef HEADLESS
 // Nils's jobmanager
 class Job
 {
@@ -245,6 +251,7 @@ protected:
 	unsigned int m_NumThreads, m_JobCount;
 	JobThread* m_JobThreadList;
 };
+#endif
 
 // Random numbers
 uint RandomUInt();
@@ -257,6 +264,7 @@ float Rand( float range );
 void FatalError( const char* fmt, ... );
 bool FileIsNewer( const char* file1, const char* file2 );
 bool FileExists( const char* f );
+uint64_t StreamBytesLeft( istream& s );
 bool RemoveFile( const char* f );
 string TextFileRead( const char* _File );
 void TextFileWrite( const string& text, const char* _File );
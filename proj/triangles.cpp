@@ -0,0 +1,404 @@
+#include "precomp.h"
+
+#ifdef _MSC_VER
+#define TARGET_AVX
+#else
+#define TARGET_AVX __attribute__((target("avx")))
+#endif
+
+namespace
+{
+    constexpr float EPSILON = 0.0000001f;
+    constexpr size_t STREAMS = 9; // Vertex 0 and both edges, per component
+
+    // Vertex 0 and both edges of consecutive triangles, one array per component
+    struct Planes
+    {
+        const float* v0x; const float* v0y; const float* v0z;
+        const float* e1x; const float* e1y; const float* e1z;
+        const float* e2x; const float* e2y; const float* e2z;
+    };
+
+    using LeafKernel = int (*)(const Planes& planes, const Ray& ray, uint first, uint count, float& t, float2& uv);
+
+    // Möller-Trumbore, returns the distance or -1 on a miss. The barycentrics are only set on a hit
+    float IntersectTriangle(const Ray& ray, const float3& vertex0, const float3& edge1, const float3& edge2, float2& uv)
+    {
+        //https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
+        const float3 h = cross(ray.dir, edge2);
+        const float a = dot(edge1, h);
+        if (a > -EPSILON && a < EPSILON)
+            return -1.f;    // This ray is parallel to this triangle.
+
+        const float f = 1.f / a;
+        const float3 s = ray.origin - vertex0;
+        const float u = f * dot(s, h);
+        if (u < 0.f || u > 1.f)
+            return -1.f;
+
+        const float3 q = cross(s, edge1);
+        const float v = f * dot(ray.dir, q);
+        if (v < 0.f || u + v > 1.f)
+            return -1.f;
+
+        // At this stage we can compute t to find out where the intersection point is on the line.
+        const float t = f * dot(edge2, q);
+        if (t <= EPSILON)
+            return -1.f;
+
+        uv = make_float2(u, v);
+        return t;
+    }
+
+    int IntersectScalar(const Planes& p, const Ray& ray, uint first, uint count, float& t, float2& uv)
+    {
+        int closest = -1;
+        for (uint i = first; i < first + count; i++)
+        {
+            float2 hitUV;
+            const float d = IntersectTriangle(ray, make_float3(p.v0x[i], p.v0y[i], p.v0z[i]),
+                make_float3(p.e1x[i], p.e1y[i], p.e1z[i]), make_float3(p.e2x[i], p.e2y[i], p.e2z[i]), hitUV);
+            if (d > 0.f && d < t)
+            {
+                t = d;
+                uv = hitUV;
+                closest = i;
+            }
+        }
+        return closest;
+    }
+
+    // Same math as the scalar version, one triangle per lane. The barycentrics are only read back from the lanes that hit
+    int IntersectSSE(const Planes& p, const Ray& ray, uint first, uint count, float& t, float2& uv)
+    {
+        const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+        const __m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+        const __m128 eps = _mm_set1_ps(EPSILON), zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+        const __m128 signMask = _mm_set1_ps(-0.f);
+        const __m128 lanes = _mm_setr_ps(0.f, 1.f, 2.f, 3.f);
+
+        int closest = -1;
+        for (uint i = 0; i < count; i += 4)
+        {
+            const uint idx = first + i;
+            const __m128 e1x = _mm_loadu_ps(p.e1x + idx), e1y = _mm_loadu_ps(p.e1y + idx), e1z = _mm_loadu_ps(p.e1z + idx);
+            const __m128 e2x = _mm_loadu_ps(p.e2x + idx), e2y = _mm_loadu_ps(p.e2y + idx), e2z = _mm_loadu_ps(p.e2z + idx);
+
+            // h = cross(dir, edge2), a = dot(edge1, h)
+            const __m128 hx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+            const __m128 hy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+            const __m128 hz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+            const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, hx), _mm_mul_ps(e1y, hy)), _mm_mul_ps(e1z, hz));
+            const __m128 f = _mm_div_ps(one, a);
+
+            // s = origin - vertex0, u = f * dot(s, h)
+            const __m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(p.v0x + idx));
+            const __m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(p.v0y + idx));
+            const __m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(p.v0z + idx));
+            const __m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)), _mm_mul_ps(sz, hz)));
+
+            // q = cross(s, edge1), v = f * dot(dir, q), t = f * dot(edge2, q)
+            const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+            const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+            const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+            const __m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)));
+            union { __m128 d4; float d[4]; };
+            d4 = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)));
+
+            // Lanes past the end of the leaf belong to other leaves
+            __m128 mask = _mm_cmplt_ps(lanes, _mm_set1_ps(static_cast<float>(count - i)));
+            mask = _mm_and_ps(mask, _mm_cmpge_ps(_mm_andnot_ps(signMask, a), eps));
+            mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+            mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+            mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(d4, eps), _mm_cmplt_ps(d4, _mm_set1_ps(t))));
+
+            const int bits = _mm_movemask_ps(mask);
+            if (bits == 0) { continue; }
+            float us[4], vs[4];
+            _mm_storeu_ps(us, u);
+            _mm_storeu_ps(vs, v);
+            for (int lane = 0; lane < 4; lane++)
+            {
+                if ((bits & (1 << lane)) && d[lane] < t)
+                {
+                    t = d[lane];
+                    uv = make_float2(us[lane], vs[lane]);
+                    closest = idx + lane;
+                }
+            }
+        }
+        return closest;
+    }
+
+    TARGET_AVX int IntersectAVX(const Planes& p, const Ray& ray, uint first, uint count, float& t, float2& uv)
+    {
+        const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+        const __m256 dx = _mm256_set1_ps(ray.dir.x), dy = _mm256_set1_ps(ray.dir.y), dz = _mm256_set1_ps(ray.dir.z);
+        const __m256 eps = _mm256_set1_ps(EPSILON), zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+        const __m256 signMask = _mm256_set1_ps(-0.f);
+        const __m256 lanes = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+
+        int closest = -1;
+        for (uint i = 0; i < count; i += 8)
+        {
+            const uint idx = first + i;
+            const __m256 e1x = _mm256_loadu_ps(p.e1x + idx), e1y = _mm256_loadu_ps(p.e1y + idx), e1z = _mm256_loadu_ps(p.e1z + idx);
+            const __m256 e2x = _mm256_loadu_ps(p.e2x + idx), e2y = _mm256_loadu_ps(p.e2y + idx), e2z = _mm256_loadu_ps(p.e2z + idx);
+
+            const __m256 hx = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+            const __m256 hy = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+            const __m256 hz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+            const __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, hx), _mm256_mul_ps(e1y, hy)), _mm256_mul_ps(e1z, hz));
+            const __m256 f = _mm256_div_ps(one, a);
+
+            const __m256 sx = _mm256_sub_ps(ox, _mm256_loadu_ps(p.v0x + idx));
+            const __m256 sy = _mm256_sub_ps(oy, _mm256_loadu_ps(p.v0y + idx));
+            const __m256 sz = _mm256_sub_ps(oz, _mm256_loadu_ps(p.v0z + idx));
+            const __m256 u = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, hx), _mm256_mul_ps(sy, hy)), _mm256_mul_ps(sz, hz)));
+
+            const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+            const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+            const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+            const __m256 v = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)));
+            union { __m256 d8; float d[8]; };
+            d8 = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)));
+
+            __m256 mask = _mm256_cmp_ps(lanes, _mm256_set1_ps(static_cast<float>(count - i)), _CMP_LT_OQ);
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_andnot_ps(signMask, a), eps, _CMP_GE_OQ));
+            mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(v, zero, _CMP_GE_OQ)));
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+            mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(d8, eps, _CMP_GT_OQ), _mm256_cmp_ps(d8, _mm256_set1_ps(t), _CMP_LT_OQ)));
+
+            const int bits = _mm256_movemask_ps(mask);
+            if (bits == 0) { continue; }
+            float us[8], vs[8];
+            _mm256_storeu_ps(us, u);
+            _mm256_storeu_ps(vs, v);
+            for (int lane = 0; lane < 8; lane++)
+            {
+                if ((bits & (1 << lane)) && d[lane] < t)
+                {
+                    t = d[lane];
+                    uv = make_float2(us[lane], vs[lane]);
+                    closest = idx + lane;
+                }
+            }
+        }
+        return closest;
+    }
+
+    bool HasAVX()
+    {
+        // The CPU has to support it and the OS has to save the ymm registers
+        uint regs[4] = {};
+#ifdef _MSC_VER
+        __cpuid(reinterpret_cast<int*>(regs), 1);
+#else
+        __get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+        const bool osxsave = (regs[2] & (1 << 27)) != 0;
+        const bool avx = (regs[2] & (1 << 28)) != 0;
+        if (!osxsave || !avx) { return false; }
+
+#ifdef _MSC_VER
+        const unsigned long long xcr0 = _xgetbv(0);
+#else
+        uint eax, edx;
+        __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        const unsigned long long xcr0 = (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+        return (xcr0 & 6) == 6;
+    }
+
+    bool HasSSE2()
+    {
+        uint regs[4] = {};
+#ifdef _MSC_VER
+        __cpuid(reinterpret_cast<int*>(regs), 1);
+#else
+        __get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+        return (regs[3] & (1 << 26)) != 0;
+    }
+
+    struct Kernel
+    {
+        LeafKernel intersect;
+        uint width;
+        const char* name;
+    };
+
+    Kernel SelectKernel()
+    {
+        if (HasAVX()) { return { IntersectAVX, 8, "AVX" }; }
+        if (HasSSE2()) { return { IntersectSSE, 4, "SSE" }; }
+        return { IntersectScalar, 1, "Scalar" };
+    }
+
+    // Picked once at startup
+    const Kernel kernel = SelectKernel();
+
+    // Rounded up so every array stays aligned, plus room for a full load from the last triangle
+    size_t Stride(size_t count)
+    {
+        return (count + TriangleStore::PADDING - 1) / TriangleStore::PADDING * TriangleStore::PADDING + TriangleStore::PADDING;
+    }
+}
+
+void TriangleStore::Build(const Model& model, std::vector<uint2> order)
+{
+    sources = std::move(order);
+    layout = model.triangleLayout;
+    if (IsIndexed())
+    {
+        data.reset();
+        Bind(model);
+    }
+    else
+    {
+        meshes.clear();
+        Allocate();
+        Pack(model);
+    }
+}
+
+void TriangleStore::Allocate()
+{
+    // aligned_alloc wants a multiple of the alignment, the arrays themselves only need 32 bytes
+    const size_t stride = Stride(sources.size());
+    const size_t bytes = (stride * STREAMS * sizeof(float) + 63) / 64 * 64;
+    data.reset(static_cast<float*>(MALLOC64(bytes)));
+
+    float** streams[STREAMS] = { &v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z };
+    for (size_t i = 0; i < STREAMS; i++)
+    {
+        *streams[i] = data.get() + i * stride;
+    }
+
+    // Zero edges are parallel to every ray so the padding never gets hit
+    memset(data.get(), 0, bytes);
+}
+
+void TriangleStore::Update(const Model& model)
+{
+    if (IsIndexed()) { Bind(model); }
+    else { Pack(model); }
+}
+
+void TriangleStore::Pack(const Model& model)
+{
+    for (uint i = 0; i < sources.size(); i++)
+    {
+        const Mesh& mesh = model.meshes[sources[i].x];
+        const auto face = mesh.Face(sources[i].y);
+        const float3 edge1 = face[1] - face[0];
+        const float3 edge2 = face[2] - face[0];
+
+        v0x[i] = face[0].x; v0y[i] = face[0].y; v0z[i] = face[0].z;
+        e1x[i] = edge1.x; e1y[i] = edge1.y; e1z[i] = edge1.z;
+        e2x[i] = edge2.x; e2y[i] = edge2.y; e2z[i] = edge2.z;
+    }
+}
+
+void TriangleStore::Bind(const Model& model)
+{
+    static_assert(sizeof(std::array<float3, 3>) == 3 * sizeof(float3), "Faces are read as consecutive vertices");
+
+    meshes.resize(model.meshes.size());
+    for (uint meshIdx = 0; meshIdx < model.meshes.size(); meshIdx++)
+    {
+        const Mesh& mesh = model.meshes[meshIdx];
+        if (mesh.IsIndexed()) { meshes[meshIdx] = { mesh.vertices.data(), mesh.indices.data() }; }
+        else { meshes[meshIdx] = { reinterpret_cast<const float3*>(mesh.faces.data()), nullptr }; }
+    }
+}
+
+void TriangleStore::Write(std::ostream& out) const
+{
+    const uint64_t count = sources.size();
+    const uint32_t storedLayout = static_cast<uint32_t>(layout);
+    out.write(reinterpret_cast<const char*>(&storedLayout), sizeof(storedLayout));
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char*>(sources.data()), count * sizeof(uint2));
+    if (IsIndexed()) { return; }
+    out.write(reinterpret_cast<const char*>(data.get()), Stride(sources.size()) * STREAMS * sizeof(float));
+}
+
+bool TriangleStore::Read(std::istream& in, const Model& model)
+{
+    uint32_t storedLayout = 0;
+    uint64_t count = 0;
+    if (!in.read(reinterpret_cast<char*>(&storedLayout), sizeof(storedLayout))) { return false; }
+    if (!in.read(reinterpret_cast<char*>(&count), sizeof(count))) { return false; }
+    layout = static_cast<TriangleLayout>(storedLayout);
+
+    if (count > StreamBytesLeft(in) / sizeof(uint2)) { return false; }
+    sources.resize(count);
+    if (!in.read(reinterpret_cast<char*>(sources.data()), count * sizeof(uint2))) { return false; }
+
+    if (IsIndexed())
+    {
+        data.reset();
+        Bind(model);
+        return true;
+    }
+
+    // The padding is read as well, it was written zeroed
+    meshes.clear();
+    Allocate();
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(data.get()), Stride(sources.size()) * STREAMS * sizeof(float)));
+}
+
+size_t TriangleStore::Memory() const
+{
+    if (IsIndexed())
+    {
+        return meshes.size() * sizeof(MeshView) + sources.size() * sizeof(uint2);
+    }
+    if (!data) { return 0; }
+    return Stride(sources.size()) * STREAMS * sizeof(float) + sources.size() * sizeof(uint2);
+}
+
+int TriangleStore::Intersect(const Ray& ray, uint first, uint count, float& t, float2& uv) const
+{
+    if (IsIndexed()) { return IntersectIndexed(ray, first, count, t, uv); }
+    return kernel.intersect({ v0x, v0y, v0z, e1x, e1y, e1z, e2x, e2y, e2z }, ray, first, count, t, uv);
+}
+
+int TriangleStore::IntersectIndexed(const Ray& ray, uint first, uint count, float& t, float2& uv) const
+{
+    // Up to PADDING triangles at a time are fetched through their indices into the arrays the kernels take.
+    // Zeroed so the lanes past the end of a leaf that the kernels load but mask out hold no garbage
+    ALIGN(32) float block[9][PADDING] = {};
+    const Planes planes = { block[0], block[1], block[2], block[3], block[4], block[5], block[6], block[7], block[8] };
+
+    int closest = -1;
+    for (uint i = 0; i < count; i += PADDING)
+    {
+        const uint n = min(PADDING, count - i);
+        for (uint j = 0; j < n; j++)
+        {
+            const uint idx = first + i + j;
+            const float3 v0 = Corner(idx, 0);
+            const float3 e1 = Corner(idx, 1) - v0;
+            const float3 e2 = Corner(idx, 2) - v0;
+            block[0][j] = v0.x; block[1][j] = v0.y; block[2][j] = v0.z;
+            block[3][j] = e1.x; block[4][j] = e1.y; block[5][j] = e1.z;
+            block[6][j] = e2.x; block[7][j] = e2.y; block[8][j] = e2.z;
+        }
+
+        const int hit = kernel.intersect(planes, ray, 0, n, t, uv);
+        if (hit >= 0) { closest = static_cast<int>(first + i) + hit; }
+    }
+    return closest;
+}
+
+uint TriangleStore::Width()
+{
+    return kernel.width;
+}
+
+const char* TriangleStore::KernelName()
+{
+    return kernel.name;
+}
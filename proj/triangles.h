@@ -0,0 +1,94 @@
+#pragma once
+
+/**
+ * Triangles for intersection in the layout the model asks for.
+ * Packed stores the precomputed vertex0, edge1 and edge2 of every triangle, one 32 byte aligned
+ * array per component, padded with triangles that can't be hit so the SIMD kernels can always load 8.
+ * Indexed keeps only the order of the triangles and reads their vertices from the meshes of the model,
+ * through the index buffer when a mesh has one, gathering the triangles of a leaf into the packed form on
+ * the stack before running the same kernels. The meshes have to stay in place until the next Build or Update.
+ */
+class TriangleStore
+{
+public:
+    static constexpr uint PADDING = 8; // Kernels may read up to this many triangles past the last one
+
+    TriangleStore() = default;
+    TriangleStore(TriangleStore&&) = default;
+    TriangleStore& operator=(TriangleStore&&) = default;
+
+    // Packs the faces of a model in its triangle layout, order lists which mesh and face go at every index
+    void Build(const Model& model, std::vector<uint2> order);
+    // Repacks the positions after the vertices of the model changed, in the same layout
+    void Update(const Model& model);
+
+    // Raw arrays for the BVH cache, Read returns false when the stream ends early. The indexed layout only
+    // stores the order, Read takes the model it was built from to read the vertices from
+    void Write(std::ostream& out) const;
+    bool Read(std::istream& in, const Model& model);
+
+    // Closest of the triangles [first, first + count) that is nearer than t. Updates t and the barycentrics
+    // uv and returns its index, or -1 when none is. Tests Width() triangles at once with the widest kernel
+    // the CPU supports
+    int Intersect(const Ray& ray, uint first, uint count, float& t, float2& uv) const;
+
+    static uint Width();
+    static const char* KernelName();
+
+    float3 Vertex0(uint i) const
+    {
+        return IsIndexed() ? Corner(i, 0) : make_float3(v0x[i], v0y[i], v0z[i]);
+    }
+    float3 Edge1(uint i) const
+    {
+        return IsIndexed() ? Corner(i, 1) - Corner(i, 0) : make_float3(e1x[i], e1y[i], e1z[i]);
+    }
+    float3 Edge2(uint i) const
+    {
+        return IsIndexed() ? Corner(i, 2) - Corner(i, 0) : make_float3(e2x[i], e2y[i], e2z[i]);
+    }
+
+    TriangleLayout Layout() const { return layout; }
+    bool IsIndexed() const { return layout == TriangleLayout::Indexed; }
+
+    // Mesh and face the triangle came from
+    uint2 Source(uint i) const { return sources[i]; }
+
+    size_t Size() const { return sources.size(); }
+    // Bytes of the packed arrays and of the sources, the indexed layout doesn't own the vertices it reads
+    size_t Memory() const;
+
+    float* v0x = nullptr; float* v0y = nullptr; float* v0z = nullptr;
+    float* e1x = nullptr; float* e1y = nullptr; float* e1z = nullptr;
+    float* e2x = nullptr; float* e2y = nullptr; float* e2z = nullptr;
+
+private:
+    // Makes zeroed arrays for the current sources
+    void Allocate();
+    void Pack(const Model& model);
+    // Points the indexed layout at the vertices and indices of the meshes
+    void Bind(const Model& model);
+    int IntersectIndexed(const Ray& ray, uint first, uint count, float& t, float2& uv) const;
+
+    // Where the corners of the faces of a mesh are read from
+    struct MeshView
+    {
+        const float3* vertices; // Three per face when the mesh has no indices
+        const uint* indices;
+    };
+
+    // Corner k of triangle i
+    float3 Corner(uint i, uint k) const
+    {
+        const MeshView& mesh = meshes[sources[i].x];
+        const size_t corner = static_cast<size_t>(sources[i].y) * 3 + k;
+        return mesh.vertices[mesh.indices ? mesh.indices[corner] : corner];
+    }
+
+    struct Free { void operator()(float* p) const { FREE64(p); } };
+
+    TriangleLayout layout = TriangleLayout::Packed;
+    std::unique_ptr<float[], Free> data; // Packed only
+    std::vector<MeshView> meshes; // Indexed only
+    std::vector<uint2> sources;
+};